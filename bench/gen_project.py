@@ -0,0 +1,165 @@
+#!/usr/bin/env python
+"""Generate a synthetic C++ project for benchmarking clang-tags.
+
+The project has HEADERS headers, each declaring SYMBOLS symbols and a chain
+of class templates TEMPLATE_DEPTH deep, and including up to two earlier
+headers.  Each of its TUS translation units includes FANOUT headers, uses
+their symbols and defines some of their functions.  A compile_commands.json
+for the project is written alongside the sources.
+
+The output depends only on the arguments, so runs on different commits
+index exactly the same code.
+"""
+
+from __future__ import print_function
+
+import argparse
+import json
+import os
+import random
+
+
+def add_arguments(parser):
+    parser.add_argument('--tus', type=int, default=100,
+                        help='number of translation units')
+    parser.add_argument('--headers', type=int, default=50,
+                        help='number of headers')
+    parser.add_argument('--fanout', type=int, default=10,
+                        help='headers included by each translation unit')
+    parser.add_argument('--symbols', type=int, default=50,
+                        help='symbols declared by each header')
+    parser.add_argument('--template-depth', type=int, default=3,
+                        help='depth of the class template chain per header')
+    parser.add_argument('--seed', type=int, default=1,
+                        help='seed for the random choices')
+
+
+def parameters(args):
+    return {'tus': args.tus, 'headers': args.headers, 'fanout': args.fanout,
+            'symbols': args.symbols, 'template_depth': args.template_depth,
+            'seed': args.seed}
+
+
+def write_header(path, index, args, rng):
+    out = ['#ifndef BENCH_H%d_HPP' % index, '#define BENCH_H%d_HPP' % index,
+           '']
+    for dep in sorted(set(rng.randrange(index) for _ in range(min(index, 2)))):
+        out.append('#include "h%d.hpp"' % dep)
+    out += ['', 'namespace bench {', 'namespace h%d {' % index, '']
+
+    for i in range(args.symbols):
+        kind = i % 4
+        if kind == 0:
+            out.append('int function%d(int argument);' % i)
+        elif kind == 1:
+            out += ['struct Class%d' % i, '{',
+                    '  int member%d;' % i,
+                    '  int method%d(int argument) const;' % i,
+                    '};']
+        elif kind == 2:
+            out.append('extern int variable%d;' % i)
+        else:
+            out.append('enum Enum%d { Enum%d_first, Enum%d_second };'
+                       % (i, i, i))
+
+    out.append('')
+    for depth in range(args.template_depth):
+        out.append('template <typename T>')
+        if depth == 0:
+            out += ['struct Template0', '{', '  T value;',
+                    '  T get() const { return value; }', '};']
+        else:
+            out += ['struct Template%d' % depth, '{',
+                    '  Template%d<T> inner;' % (depth - 1),
+                    '  T get() const { return inner.get(); }', '};']
+    if args.template_depth:
+        out.append('typedef Template%d<int> deep_type;'
+                   % (args.template_depth - 1))
+
+    out += ['', '} // namespace h%d' % index, '} // namespace bench', '',
+            '#endif', '']
+    with open(path, 'w') as f:
+        f.write('\n'.join(out))
+
+
+def write_source(path, index, args, rng):
+    headers = sorted(rng.sample(range(args.headers),
+                                min(args.fanout, args.headers)))
+    out = ['#include "h%d.hpp"' % h for h in headers]
+    out += ['', 'namespace bench {', '']
+
+    # Each function and method is defined by exactly one translation unit.
+    owner = [h for h in headers if h % args.tus == index % args.tus]
+    for h in owner:
+        for i in range(0, args.symbols, 4):
+            out += ['int h%d::function%d(int argument)' % (h, i), '{',
+                    '  return argument + %d;' % i, '}']
+        for i in range(1, args.symbols, 4):
+            out += ['int h%d::Class%d::method%d(int argument) const'
+                    % (h, i, i), '{',
+                    '  return member%d + argument;' % i, '}']
+
+    out += ['', 'int tu%d_main()' % index, '{', '  int total = 0;']
+    for h in headers:
+        for i in rng.sample(range(args.symbols), min(args.symbols, 8)):
+            kind = i % 4
+            if kind == 0:
+                out.append('  total += h%d::function%d(total);' % (h, i))
+            elif kind == 1:
+                out += ['  h%d::Class%d object%d_%d;' % (h, i, h, i),
+                        '  total += object%d_%d.method%d(total);'
+                        % (h, i, i)]
+            elif kind == 2:
+                out.append('  total += h%d::variable%d;' % (h, i))
+            else:
+                out.append('  total += h%d::Enum%d_second;' % (h, i))
+        if args.template_depth:
+            out += ['  h%d::deep_type deep%d;' % (h, h),
+                    '  total += deep%d.get();' % h]
+    out += ['  return total;', '}', '', '} // namespace bench', '']
+    with open(path, 'w') as f:
+        f.write('\n'.join(out))
+
+
+def generate(directory, args):
+    """Write the project into DIRECTORY, returning its source paths."""
+    rng = random.Random(args.seed)
+    directory = os.path.abspath(directory)
+    include_dir = os.path.join(directory, 'include')
+    source_dir = os.path.join(directory, 'src')
+    for d in (include_dir, source_dir):
+        if not os.path.isdir(d):
+            os.makedirs(d)
+
+    for i in range(args.headers):
+        write_header(os.path.join(include_dir, 'h%d.hpp' % i), i, args, rng)
+
+    sources = []
+    commands = []
+    for i in range(args.tus):
+        source = os.path.join(source_dir, 'tu%d.cpp' % i)
+        write_source(source, i, args, rng)
+        sources.append(source)
+        commands.append({
+            'directory': directory,
+            'command': 'c++ -I%s -c %s -o %s.o' % (include_dir, source,
+                                                   source),
+            'file': source})
+
+    with open(os.path.join(directory, 'compile_commands.json'), 'w') as f:
+        json.dump(commands, f, indent=2)
+    return sources
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('directory', help='where to write the project')
+    add_arguments(parser)
+    args = parser.parse_args()
+    sources = generate(args.directory, args)
+    print('Generated %d translation units in %s'
+          % (len(sources), args.directory))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,289 @@
+// Compare the indexer's SymbolNames cache, an interner plus an OpenHashMap
+// keyed by (parent scope, name), against a std::map<std::pair<int,
+// std::string>, int> over the same rows.  The input holds one qualified
+// name per line, which is split into the scope tree the indexer builds.
+// Dump it from an existing database with:
+//
+//   sqlite3 CLTAGS > names.txt <<'EOF'
+//   WITH RECURSIVE Full(id, full_name) AS (
+//     SELECT s.id, n.name FROM SymbolNames s, Names n
+//      WHERE n.id = s.name_id AND s.parent_id = 0
+//     UNION ALL
+//     SELECT s.id, f.full_name || '::' || n.name
+//       FROM SymbolNames s, Names n, Full f
+//      WHERE n.id = s.name_id AND s.parent_id = f.id)
+//   SELECT full_name FROM Full;
+//   EOF
+//
+// or from the symbols of any C++ library, whose parameter lists are
+// dropped:
+//
+//   nm -DC --defined-only libfoo.so | cut -d' ' -f3- |
+//     grep -v ' for ' > names.txt
+//
+// then run: intern-bench names.txt [passes [runs]]
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <new>
+
+#include <sys/time.h>
+
+#include "intern.h"
+
+// Count heap bytes so that the std::map's footprint can be reported.  The
+// interner allocates its arena with malloc, so it reports its own, which
+// leaves out only the unused end of its last arena block.
+static std::size_t heap_bytes = 0;
+
+void * operator new(std::size_t size)
+{
+  void * p = std::malloc(size + sizeof(std::size_t));
+  if (! p)
+    throw std::bad_alloc();
+  *static_cast<std::size_t *>(p) = size;
+  heap_bytes += size;
+  return static_cast<std::size_t *>(p) + 1;
+}
+
+// Kept out of line: once inlined into its callers, GCC takes the free()
+// of a block from operator new for a mismatched deallocation.
+__attribute__((noinline)) static void release(void * p)
+{
+  std::size_t * block = static_cast<std::size_t *>(p) - 1;
+  heap_bytes -= *block;
+  std::free(block);
+}
+
+void operator delete(void * p)
+{
+  if (p)
+    release(p);
+}
+
+// C++14 compilers call this one for objects of known size.
+void operator delete(void * p, std::size_t)
+{
+  operator delete(p);
+}
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// A symbol's enclosing scope, zero at global scope, and its own name, as
+// in the indexer's cache (see SymbolName in main.cpp).
+struct SymbolName
+{
+  int parent_id;
+  int name_id;
+
+  SymbolName() : parent_id(0), name_id(0) {}
+  SymbolName(int parent_id, int name_id)
+    : parent_id(parent_id), name_id(name_id) {}
+
+  uint32_t hash() const {
+    int ints[] = { parent_id, name_id };
+    return hash_ints(ints, 2);
+  }
+  bool operator==(const SymbolName& right) const {
+    return (parent_id == right.parent_id && name_id == right.name_id);
+  }
+};
+
+// A row of SymbolNames: its parent's row, counting from one, and its name.
+typedef std::pair<int, std::string> scope_row;
+
+// Split NAME at "::" outside brackets, as the indexer does.  Demangled
+// functions are accepted too: a return type, ending at a space outside
+// brackets, and the parameters, starting at a parenthesis, are dropped.
+// An operator's name runs to its parameters, so that its symbol is never
+// taken for brackets.
+static std::vector<std::string> split_name(const std::string& name)
+{
+  std::vector<std::string> components;
+  std::size_t start = 0;
+  std::size_t end = name.size();
+  int depth = 0;
+  for (std::size_t i = 0; i < name.size(); ++i) {
+    if (name.compare(i, 8, "operator") == 0 && i == start) {
+      std::size_t symbol = i + 8;
+      if (name.compare(symbol, 2, "()") == 0)
+        symbol += 2;
+      end = std::min(name.find('(', symbol), name.size());
+      break;
+    }
+    char c = name[i];
+    if (c == '(' && depth == 0 && i > start) {
+      end = i;
+      break;
+    }
+    if (c == '<' || c == '(' || c == '[')
+      ++depth;
+    else if ((c == '>' || c == ')' || c == ']') && depth > 0)
+      --depth;
+    else if (c == ' ' && depth == 0) {
+      components.clear();
+      start = i + 1;
+    }
+    else if (c == ':' && depth == 0 && name.compare(i, 2, "::") == 0) {
+      components.push_back(name.substr(start, i - start));
+      start = ++i + 1;
+    }
+  }
+  components.push_back(name.substr(start, end - start));
+  return components;
+}
+
+// The times of one run of a structure over all the rows.
+struct Timing
+{
+  double      insert_time;
+  double      lookup_time;
+  std::size_t bytes;
+  std::size_t count;
+
+  Timing() : insert_time(0), lookup_time(0), bytes(0), count(0) {}
+
+  // Keep the fastest of several runs, which are less disturbed by the
+  // rest of the machine.
+  void keep_best(const Timing& run) {
+    if (! count || run.insert_time < insert_time)
+      insert_time = run.insert_time;
+    if (! count || run.lookup_time < lookup_time)
+      lookup_time = run.lookup_time;
+    bytes = run.bytes;
+    count = run.count;
+  }
+};
+
+static Timing time_std_map(const std::vector<scope_row>& rows, int passes,
+                           long& checksum)
+{
+  Timing timing;
+  std::size_t before = heap_bytes;
+  std::map<scope_row, int> map;
+
+  double start = now();
+  for (std::size_t i = 0; i < rows.size(); ++i)
+    map.insert(std::make_pair(scope_row(rows[i].first, rows[i].second),
+                              static_cast<int>(i + 1)));
+  double inserted = now();
+  for (int pass = 0; pass < passes; ++pass)
+    for (std::size_t i = 0; i < rows.size(); ++i)
+      checksum += map.find(scope_row(rows[i].first,
+                                     rows[i].second))->second;
+  double looked_up = now();
+
+  timing.insert_time = inserted - start;
+  timing.lookup_time = looked_up - inserted;
+  timing.bytes       = heap_bytes - before;
+  timing.count       = map.size();
+  return timing;
+}
+
+static Timing time_interner(const std::vector<scope_row>& rows, int passes,
+                            long& checksum)
+{
+  Timing timing;
+  StringInterner strings;
+  OpenHashMap<SymbolName> map;
+
+  double start = now();
+  for (std::size_t i = 0; i < rows.size(); ++i)
+    map.insert(SymbolName(rows[i].first,
+                          static_cast<int>(
+                            strings.intern(rows[i].second.data(),
+                                           rows[i].second.size()))),
+               static_cast<int>(i + 1));
+  double inserted = now();
+  for (int pass = 0; pass < passes; ++pass)
+    for (std::size_t i = 0; i < rows.size(); ++i)
+      checksum += *map.find(SymbolName(rows[i].first,
+                                       static_cast<int>(
+                                         strings.find(
+                                           rows[i].second.data(),
+                                           rows[i].second.size()))));
+  double looked_up = now();
+
+  timing.insert_time = inserted - start;
+  timing.lookup_time = looked_up - inserted;
+  timing.bytes       = strings.memory_usage() + map.memory_usage();
+  timing.count       = map.size();
+  return timing;
+}
+
+static void report(const char * name, const Timing& timing, int passes)
+{
+  std::size_t count = timing.count;
+  std::cout << name << ":\n"
+            << "  insert " << timing.insert_time * 1e9 / count
+            << " ns/name\n"
+            << "  lookup " << timing.lookup_time * 1e9 / (count * passes)
+            << " ns/name\n"
+            << "  memory " << timing.bytes / 1024 << " KB ("
+            << static_cast<double>(timing.bytes) / count << " bytes/name)\n";
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::cerr << "Usage: intern-bench NAMES.txt [PASSES [RUNS]]" << std::endl;
+    return 2;
+  }
+  int passes = argc > 2 ? std::atoi(argv[2]) : 5;
+  int runs   = argc > 3 ? std::atoi(argv[3]) : 5;
+
+  // The rows of the scope tree, in the order the indexer would add them.
+  std::vector<scope_row> rows;
+  {
+    std::map<scope_row, int> ids;
+    std::ifstream in(argv[1]);
+    std::string line;
+    while (std::getline(in, line)) {
+      if (line.empty())
+        continue;
+      std::vector<std::string> components(split_name(line));
+      int parent = 0;
+      for (std::size_t i = 0; i < components.size(); ++i) {
+        scope_row row(parent, components[i]);
+        std::map<scope_row, int>::iterator id = ids.find(row);
+        if (id == ids.end()) {
+          rows.push_back(row);
+          id = ids.insert(std::make_pair(row,
+                                         static_cast<int>(rows.size()))).first;
+        }
+        parent = (*id).second;
+      }
+    }
+  }
+  if (rows.empty()) {
+    std::cerr << "No names read from " << argv[1] << std::endl;
+    return 1;
+  }
+  std::cout << rows.size() << " scope rows, " << passes
+            << " lookup passes, best of " << runs << " runs" << std::endl;
+
+  long   checksum = 0;
+  Timing std_map;
+  Timing interner;
+  for (int run = 0; run < runs; ++run) {
+    std_map.keep_best(time_std_map(rows, passes, checksum));
+    interner.keep_best(time_interner(rows, passes, checksum));
+  }
+  report("std::map<pair<int, string>, int>", std_map, passes);
+  report("StringInterner + OpenHashMap<SymbolName>", interner, passes);
+
+  // Keep the lookups from being optimized away.
+  return checksum == -1;
+}
+
+// intern_bench.cpp ends here
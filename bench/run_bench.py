@@ -0,0 +1,221 @@
+#!/usr/bin/env python
+"""Benchmark clang-tags on a generated project and report the results as JSON.
+
+The phases measured are generating the project, indexing it from scratch,
+a no-op 'update', and answering 'decl' queries through 'serve'.  For each
+clang-tags run the wall time and peak RSS are recorded; for the index the
+declarations per second and the final size of CLTAGS; for the queries the
+latency percentiles.  Pass --compare with an earlier result file to print
+how this run differs from it.
+"""
+
+from __future__ import print_function
+
+import argparse
+import json
+import os
+import random
+import shutil
+import signal
+import socket
+import sqlite3
+import subprocess
+import sys
+import time
+
+import gen_project
+
+
+def run_timed(command, cwd):
+    """Run COMMAND in CWD, returning its wall time and peak RSS in KB."""
+    start = time.time()
+    process = subprocess.Popen(command, cwd=cwd)
+    _, status, usage = os.wait4(process.pid, 0)
+    elapsed = time.time() - start
+    if status != 0:
+        sys.exit('%s failed with status %d' % (' '.join(command), status))
+    return {'seconds': elapsed, 'peak_rss_kb': usage.ru_maxrss}
+
+
+def database_size(work):
+    size = 0
+    for suffix in ('', '-wal', '-shm'):
+        path = os.path.join(work, 'CLTAGS' + suffix)
+        if os.path.exists(path):
+            size += os.path.getsize(path)
+    return size
+
+
+def count_declarations(work):
+    db = sqlite3.connect(os.path.join(work, 'CLTAGS'))
+    try:
+        return db.execute('SELECT COUNT(*) FROM DeclRefs '
+                          'WHERE ref_kind_id IN (1, 2)').fetchone()[0]
+    finally:
+        db.close()
+
+
+def sample_names(work, count, seed):
+    db = sqlite3.connect(os.path.join(work, 'CLTAGS'))
+    try:
+        # Qualified names are stored as a tree of scopes.
+        names = [row[0] for row in db.execute(
+            'WITH RECURSIVE Full(id, name) AS ('
+            ' SELECT SymbolNames.id, Names.name FROM SymbolNames, Names'
+            '  WHERE Names.id = SymbolNames.name_id'
+            '    AND SymbolNames.parent_id = 0'
+            ' UNION ALL'
+            ' SELECT SymbolNames.id, Full.name || \'::\' || Names.name'
+            '   FROM SymbolNames, Names, Full'
+            '  WHERE Names.id = SymbolNames.name_id'
+            '    AND SymbolNames.parent_id = Full.id)'
+            ' SELECT name FROM Full WHERE id IN'
+            ' (SELECT symbol_name_id FROM Declarations)')]
+    finally:
+        db.close()
+    rng = random.Random(seed)
+    return [rng.choice(names) for _ in range(count)] if names else []
+
+
+def query(connection, request):
+    connection.sendall((request + '\n').encode('utf-8'))
+    reply = b''
+    while not (reply == b'\n' or reply.endswith(b'\n\n')):
+        chunk = connection.recv(65536)
+        if not chunk:
+            sys.exit('serve closed the connection')
+        reply += chunk
+    return reply
+
+
+def percentile(values, fraction):
+    ordered = sorted(values)
+    index = min(len(ordered) - 1, int(round(fraction * (len(ordered) - 1))))
+    return ordered[index]
+
+
+def measure_queries(clang_tags, work, names):
+    socket_path = os.path.join(work, 'bench.sock')
+    server = subprocess.Popen([clang_tags, 'serve', '--socket', socket_path],
+                              cwd=work)
+    try:
+        connection = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        for _ in range(500):
+            try:
+                connection.connect(socket_path)
+                break
+            except socket.error:
+                if server.poll() is not None:
+                    sys.exit('serve exited with status %d' % server.returncode)
+                time.sleep(0.01)
+        else:
+            sys.exit('serve did not start listening on ' + socket_path)
+
+        latencies = []
+        for name in names:
+            start = time.time()
+            query(connection, 'decl ' + name)
+            latencies.append((time.time() - start) * 1000.0)
+        connection.close()
+    finally:
+        server.send_signal(signal.SIGTERM)
+        server.wait()
+
+    if not latencies:
+        return {}
+    return {'count': len(latencies),
+            'p50': percentile(latencies, 0.50),
+            'p90': percentile(latencies, 0.90),
+            'p99': percentile(latencies, 0.99),
+            'max': max(latencies)}
+
+
+def git_commit():
+    try:
+        here = os.path.dirname(os.path.abspath(__file__))
+        return subprocess.check_output(['git', 'rev-parse', 'HEAD'],
+                                       cwd=here).decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def flatten(results, prefix=''):
+    values = {}
+    for key, value in results.items():
+        if isinstance(value, dict):
+            values.update(flatten(value, prefix + key + '.'))
+        elif isinstance(value, (int, float)) and not isinstance(value, bool):
+            values[prefix + key] = value
+    return values
+
+
+def compare(old, new):
+    old_values = flatten(old)
+    new_values = flatten(new)
+    print('%-32s %14s %14s %8s' % ('metric', 'before', 'after', 'change'))
+    for key in sorted(new_values):
+        if key.startswith('parameters.') or key not in old_values:
+            continue
+        before = old_values[key]
+        after = new_values[key]
+        change = ('%+7.1f%%' % (100.0 * (after - before) / before)
+                  if before else '')
+        print('%-32s %14.6g %14.6g %8s' % (key, before, after, change))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--clang-tags', required=True,
+                        help='the clang-tags executable to measure')
+    parser.add_argument('--work', default='bench-work',
+                        help='directory for the project and its CLTAGS')
+    parser.add_argument('--output', default='bench-results.json',
+                        help='file to write the results to')
+    parser.add_argument('--compare', metavar='RESULTS',
+                        help='earlier results to compare against')
+    parser.add_argument('--jobs', type=int, default=1,
+                        help='value of -j for the indexing run')
+    parser.add_argument('--queries', type=int, default=1000,
+                        help='number of decl queries to time')
+    gen_project.add_arguments(parser)
+    args = parser.parse_args()
+
+    clang_tags = os.path.abspath(args.clang_tags)
+    work = os.path.abspath(args.work)
+    if os.path.isdir(work):
+        shutil.rmtree(work)
+
+    results = {'commit': git_commit(),
+               'parameters': gen_project.parameters(args),
+               'phases': {}}
+    results['parameters']['jobs'] = args.jobs
+
+    start = time.time()
+    sources = gen_project.generate(work, args)
+    results['phases']['generate'] = {'seconds': time.time() - start}
+
+    index = run_timed([clang_tags, work] + sources + ['-j', str(args.jobs)],
+                      work)
+    declarations = count_declarations(work)
+    index['declarations'] = declarations
+    index['declarations_per_second'] = declarations / index['seconds']
+    index['database_bytes'] = database_size(work)
+    results['phases']['index'] = index
+
+    results['phases']['update'] = run_timed([clang_tags, 'update', work],
+                                            work)
+
+    names = sample_names(work, args.queries, args.seed)
+    results['decl_latency_ms'] = measure_queries(clang_tags, work, names)
+
+    with open(args.output, 'w') as f:
+        json.dump(results, f, indent=2, sort_keys=True)
+    print(json.dumps(results, indent=2, sort_keys=True))
+
+    if args.compare:
+        with open(args.compare) as f:
+            compare(json.load(f), results)
+
+
+if __name__ == '__main__':
+    main()
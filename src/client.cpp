@@ -0,0 +1,84 @@
+// A minimal client for 'clang-tags serve': sends one query over the server's
+// Unix domain socket and prints the reply.
+//
+//   clang-tags-client [--socket PATH] COMMAND ARGUMENT
+
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/unistd.h>
+
+int main(int argc, char **argv) {
+  std::string socket_path("./CLTAGS.sock");
+
+  int arg = 1;
+  if (arg + 1 < argc && std::string(argv[arg]) == "--socket") {
+    socket_path = argv[arg + 1];
+    arg += 2;
+  }
+  if (argc - arg != 2) {
+    std::cerr << "Usage: clang-tags-client [--socket PATH] COMMAND ARGUMENT"
+              << std::endl;
+    return 2;
+  }
+
+  struct sockaddr_un address;
+  if (socket_path.size() >= sizeof address.sun_path) {
+    std::cerr << "Socket path too long: " << socket_path << std::endl;
+    return 2;
+  }
+  std::memset(&address, 0, sizeof address);
+  address.sun_family = AF_UNIX;
+  std::strcpy(address.sun_path, socket_path.c_str());
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1 ||
+      connect(fd, reinterpret_cast<struct sockaddr *>(&address),
+              sizeof address) != 0) {
+    std::cerr << "Cannot connect to " << socket_path << ": "
+              << std::strerror(errno) << std::endl;
+    return 1;
+  }
+
+  std::string request(std::string(argv[arg]) + " " + argv[arg + 1] + "\n");
+  const char * p   = request.data();
+  const char * end = p + request.size();
+  while (p != end) {
+    ssize_t written = write(fd, p, end - p);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      std::cerr << "write: " << std::strerror(errno) << std::endl;
+      return 1;
+    }
+    p += written;
+  }
+
+  // The reply ends with an empty line.
+  std::string reply;
+  char buffer[65536];
+  for (;;) {
+    ssize_t length = read(fd, buffer, sizeof buffer);
+    if (length < 0 && errno == EINTR)
+      continue;
+    if (length <= 0)
+      break;
+    reply.append(buffer, length);
+    if (reply == "\n" ||
+        (reply.size() >= 2 && reply.compare(reply.size() - 2, 2, "\n\n") == 0))
+      break;
+  }
+  close(fd);
+
+  if (! reply.empty())
+    reply.erase(reply.size() - 1);
+  std::cout << reply;
+
+  return reply.compare(0, 6, "error:") == 0 ? 1 : 0;
+}
+
+// client.cpp ends here
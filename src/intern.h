@@ -0,0 +1,257 @@
+#ifndef CLANG_TAGS_INTERN_H
+#define CLANG_TAGS_INTERN_H
+
+// Compact in-memory caches for the indexer: a string interner whose text
+// lives in an arena, and an open-addressing hash map from small fixed-size
+// keys to ints.  Neither depends on LLVM, so the benchmarks can use them.
+
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <new>
+
+#include <stdint.h>
+
+// 32-bit FNV-1a.  Never returns zero, which the tables below use to mark
+// empty slots.
+inline uint32_t hash_bytes(const char * data, std::size_t length,
+                           uint32_t hash = 2166136261U)
+{
+  for (const char * end = data + length; data != end; ++data) {
+    hash ^= static_cast<unsigned char>(*data);
+    hash *= 16777619U;
+  }
+  return hash ? hash : 1;
+}
+
+inline uint32_t hash_ints(const int * ints, std::size_t count)
+{
+  return hash_bytes(reinterpret_cast<const char *>(ints),
+                    count * sizeof(int));
+}
+
+// Maps strings to dense ids, storing each distinct string once.  Text is
+// copied into large arena blocks as a 32-bit length followed by the bytes,
+// and the table holds only an id and the precomputed hash per string.
+class StringInterner
+{
+  static const std::size_t block_size = 1 << 20;
+
+  std::vector<char *>       blocks;
+  char *                    current_block;
+  std::size_t               block_used;
+  std::vector<const char *> strings;
+  std::vector<uint32_t>     slot_hashes;
+  std::vector<uint32_t>     slot_ids;
+  std::size_t               arena_bytes;
+
+public:
+  StringInterner()
+    : current_block(NULL), block_used(0), slot_hashes(64, 0), slot_ids(64, 0),
+      arena_bytes(0) {}
+
+  ~StringInterner() {
+    for (std::size_t i = 0; i < blocks.size(); ++i)
+      std::free(blocks[i]);
+  }
+
+  // Return the id of TEXT, adding it if it has not been seen before.
+  uint32_t intern(const char * text, std::size_t length)
+  {
+    uint32_t hash = hash_bytes(text, length);
+    std::size_t slot = find_slot(text, length, hash);
+    if (slot_hashes[slot])
+      return slot_ids[slot];
+
+    uint32_t id = static_cast<uint32_t>(strings.size());
+    strings.push_back(store(text, length));
+    slot_hashes[slot] = hash;
+    slot_ids[slot]    = id;
+
+    if (strings.size() * 10 > slot_hashes.size() * 7)
+      grow();
+    return id;
+  }
+
+  // Return the id of TEXT, or -1 if it has never been interned.
+  long find(const char * text, std::size_t length) const
+  {
+    std::size_t slot = find_slot(text, length, hash_bytes(text, length));
+    return slot_hashes[slot] ? static_cast<long>(slot_ids[slot]) : -1;
+  }
+
+  const char * data(uint32_t id) const {
+    return strings[id] + sizeof(uint32_t);
+  }
+  std::size_t length(uint32_t id) const {
+    uint32_t length;
+    std::memcpy(&length, strings[id], sizeof length);
+    return length;
+  }
+
+  std::size_t size() const {
+    return strings.size();
+  }
+
+  // Bytes held by the arena and tables, excluding unused arena space.
+  std::size_t memory_usage() const {
+    return arena_bytes + strings.capacity() * sizeof(const char *) +
+      slot_hashes.capacity() * 2 * sizeof(uint32_t);
+  }
+
+private:
+  std::size_t find_slot(const char * text, std::size_t length,
+                        uint32_t hash) const
+  {
+    std::size_t mask = slot_hashes.size() - 1;
+    for (std::size_t slot = hash & mask; ; slot = (slot + 1) & mask) {
+      if (! slot_hashes[slot])
+        return slot;
+      if (slot_hashes[slot] == hash &&
+          this->length(slot_ids[slot]) == length &&
+          std::memcmp(data(slot_ids[slot]), text, length) == 0)
+        return slot;
+    }
+  }
+
+  const char * store(const char * text, std::size_t length)
+  {
+    std::size_t needed = sizeof(uint32_t) + length;
+    needed = (needed + 3) & ~std::size_t(3);
+    arena_bytes += needed;
+
+    // A string too long for a block gets one of its own.
+    if (needed > block_size)
+      return write(allocate_block(needed), text, length);
+
+    if (! current_block || block_used + needed > block_size) {
+      current_block = allocate_block(block_size);
+      block_used    = 0;
+    }
+    char * p = current_block + block_used;
+    block_used += needed;
+    return write(p, text, length);
+  }
+
+  char * allocate_block(std::size_t size)
+  {
+    char * block = static_cast<char *>(std::malloc(size));
+    if (! block)
+      throw std::bad_alloc();
+    blocks.push_back(block);
+    return block;
+  }
+
+  static const char * write(char * p, const char * text, std::size_t length)
+  {
+    uint32_t stored_length = static_cast<uint32_t>(length);
+    std::memcpy(p, &stored_length, sizeof stored_length);
+    std::memcpy(p + sizeof stored_length, text, length);
+    return p;
+  }
+
+  void grow()
+  {
+    std::vector<uint32_t> hashes(slot_hashes.size() * 2, 0);
+    std::vector<uint32_t> ids(hashes.size(), 0);
+    std::size_t mask = hashes.size() - 1;
+    for (std::size_t i = 0; i < slot_hashes.size(); ++i) {
+      if (! slot_hashes[i])
+        continue;
+      std::size_t slot = slot_hashes[i] & mask;
+      while (hashes[slot])
+        slot = (slot + 1) & mask;
+      hashes[slot] = slot_hashes[i];
+      ids[slot]    = slot_ids[i];
+    }
+    slot_hashes.swap(hashes);
+    slot_ids.swap(ids);
+  }
+};
+
+// An open-addressing (linear probing) hash map from KEY to int.  KEY must
+// be a plain struct of ints with an operator== and a hash() member
+// returning a non-zero value, which the map stores alongside the key so
+// that probes and rehashes never recompute it.
+template <typename Key>
+class OpenHashMap
+{
+  struct Slot
+  {
+    uint32_t hash;              // zero if the slot is empty
+    int      value;
+    Key      key;
+
+    Slot() : hash(0), value(0) {}
+  };
+
+  std::vector<Slot> slots;
+  std::size_t       count;
+
+public:
+  OpenHashMap() : slots(64), count(0) {}
+
+  // Return a pointer to the value stored for KEY, or NULL.
+  int * find(const Key& key)
+  {
+    Slot& slot(slots[find_slot(key, key.hash())]);
+    return slot.hash ? &slot.value : NULL;
+  }
+
+  void insert(const Key& key, int value)
+  {
+    uint32_t hash = key.hash();
+    Slot& slot(slots[find_slot(key, hash)]);
+    if (! slot.hash) {
+      slot.hash = hash;
+      slot.key  = key;
+      if (++count * 10 > slots.size() * 7) {
+        slot.value = value;
+        grow();
+        return;
+      }
+    }
+    slot.value = value;
+  }
+
+  void clear() {
+    std::vector<Slot>(64).swap(slots);
+    count = 0;
+  }
+
+  std::size_t size() const {
+    return count;
+  }
+
+  std::size_t memory_usage() const {
+    return slots.capacity() * sizeof(Slot);
+  }
+
+private:
+  std::size_t find_slot(const Key& key, uint32_t hash) const
+  {
+    std::size_t mask = slots.size() - 1;
+    for (std::size_t i = hash & mask; ; i = (i + 1) & mask)
+      if (! slots[i].hash || (slots[i].hash == hash && slots[i].key == key))
+        return i;
+  }
+
+  void grow()
+  {
+    std::vector<Slot> old(slots.size() * 2);
+    old.swap(slots);
+    std::size_t mask = slots.size() - 1;
+    for (std::size_t i = 0; i < old.size(); ++i) {
+      if (! old[i].hash)
+        continue;
+      std::size_t slot = old[i].hash & mask;
+      while (slots[slot].hash)
+        slot = (slot + 1) & mask;
+      slots[slot] = old[i];
+    }
+  }
+};
+
+#endif // CLANG_TAGS_INTERN_H
+
+// intern.h ends here
@@ -5,15 +5,39 @@
 #include <clang/Frontend/FrontendActions.h>
 #include <clang/Tooling/CompilationDatabase.h>
 #include <clang/Tooling/Tooling.h>
+#include <llvm/Support/Allocator.h>
+#include <llvm/Support/Threading.h>
 
 #include <stdexcept>
 #include <sstream>
 #include <iostream>
 #include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
 #include <cassert>
+#include <cctype>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
 
 #include <sqlite3.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <sys/unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <signal.h>
+
+#include "intern.h"
 
 #if !defined(__has_feature) || !__has_feature(address_sanitizer)
 #define HAVE_EXCEPTIONS 1
@@ -34,13 +58,183 @@ public:
   std::string name;
 };
 
-class TagsDatabase
+// A symbol offered as the completion of a prefix, with the kinds of its
+// declarations, e.g. "function,type".
+class TagsCompletion
+{
+public:
+  std::string short_name;
+  std::string full_name;
+  std::string kinds;
+};
+
+// A symbol whose short name matches a prefix, ordered best first: exact
+// matches, then those matching in case, then the shortest.  ID identifies
+// the symbol to the backend that found it.
+struct TagsCompletionCandidate
+{
+  long           id;
+  bool           exact;
+  bool           case_match;
+  TagsCompletion completion;
+
+  bool operator<(const TagsCompletionCandidate& right) const {
+    if (exact != right.exact)
+      return exact;
+    if (case_match != right.case_match)
+      return case_match;
+    const std::string& name(completion.short_name);
+    const std::string& right_name(right.completion.short_name);
+    if (name.size() != right_name.size())
+      return name.size() < right_name.size();
+    if (name != right_name)
+      return name < right_name;
+    return completion.full_name < right.completion.full_name;
+  }
+};
+
+// At most this many symbols matching a prefix are ranked, so that a short
+// prefix costs no more than a long one.
+const std::size_t CompletionCandidates = 2000;
+
+// Keep the best LIMIT of CANDIDATES, in order.
+void rank_completions(std::vector<TagsCompletionCandidate>& candidates,
+                      unsigned limit)
+{
+  if (candidates.size() > limit) {
+    std::partial_sort(candidates.begin(), candidates.begin() + limit,
+                      candidates.end());
+    candidates.resize(limit);
+  } else {
+    std::sort(candidates.begin(), candidates.end());
+  }
+}
+
+// A source file as the operating system knows it: its device and inode,
+// and its modification time so that an inode reused by another file is
+// not mistaken for it.  All zero if the file has no inode, such as one
+// mapped into memory by the compiler.
+struct TagsFileIdentity
+{
+  uint64_t device;
+  uint64_t inode;
+  int64_t  mtime;
+
+  TagsFileIdentity() : device(0), inode(0), mtime(0) {}
+  TagsFileIdentity(uint64_t device, uint64_t inode, int64_t mtime)
+    : device(device), inode(inode), mtime(mtime) {}
+
+  bool known() const {
+    return inode != 0;
+  }
+
+  uint32_t hash() const {
+    uint64_t fields[] = { device, inode, static_cast<uint64_t>(mtime) };
+    return hash_bytes(reinterpret_cast<const char *>(fields),
+                      sizeof fields);
+  }
+
+  bool operator==(const TagsFileIdentity& right) const {
+    return (device == right.device && inode == right.inode &&
+            mtime == right.mtime);
+  }
+  bool operator<(const TagsFileIdentity& right) const {
+    if (device != right.device)
+      return device < right.device;
+    if (inode != right.inode)
+      return inode < right.inode;
+    return mtime < right.mtime;
+  }
+};
+
+// A declaration or a reference to one as seen by the indexer, reduced to
+// plain data so that it can outlive the AST it was taken from.  The
+// exception is LINE_TEXT, which points into the source buffer; a sink that
+// keeps records beyond the translation unit must copy it.  DIRNAME and
+// PATHNAME are canonical, and the indexer points them into the process's
+// CanonicalPathCache, so they stay valid for as long as any record.
+//
+// FILE identifies the file, if known, so that a sink can recognize it
+// without looking at its path.  REF_KIND_ID is a DeclRefKinds id.
+// CONTEXT_REF is the handle the same sink returned for the enclosing
+// declaration, or zero if there is none.
+class TagsDeclRecord
+{
+public:
+  llvm::StringRef  dirname;
+  llvm::StringRef  pathname;
+  TagsFileIdentity file;
+  int              line_no;
+  int              col_no;
+  llvm::StringRef  line_text;
+  std::string      short_name;
+  std::string      full_name;
+  int              kind_id;
+  int              is_definition;
+  int              is_implicit;
+  int              ref_kind_id;
+  long             context_ref;
+};
+
+// A source file whose declarations have all been indexed, identified by
+// its contents so that later translation units and later runs can tell
+// whether it has changed since.
+class TagsFileRecord
 {
 public:
-  virtual void add_declaration(NamedDecl *Declaration) = 0;
+  std::string      dirname;
+  std::string      pathname;
+  TagsFileIdentity file;
+  long long        mtime;
+  long long        size;
+  uint64_t         content_hash;
+};
+
+// How completely a file has been indexed: every declaration and use, with
+// --fast only the declarations at namespace and class scope, or with
+// --macros-only nothing but its macros.  Files of the lesser tiers are
+// indexed again in full by the next 'update' that is neither.
+enum IndexTier
+{
+  TierFull         = 0,
+  TierDeclarations = 1,
+  TierMacros       = 2
+};
+
+// A translation unit that has been indexed, with every file it included.
+class TagsTranslationUnitRecord
+{
+public:
+  TagsFileRecord              main_file;
+  std::vector<TagsFileRecord> included_files;
+  IndexTier                   tier;
+};
 
+class TagsDeclSink
+{
+public:
+  virtual ~TagsDeclSink() {}
+
+  // Returns a non-zero handle by which later records may name this one as
+  // their context.
+  virtual long add_declaration(const TagsDeclRecord& record) = 0;
+  virtual void
+  add_translation_unit(const TagsTranslationUnitRecord& record) = 0;
+};
+
+class TagsDatabase : public TagsDeclSink
+{
+public:
   virtual std::vector<TagsDeclInfo>
   find_declaration(const std::string& name) = 0;
+  virtual std::vector<TagsDeclInfo>
+  find_references(const std::string& name) = 0;
+  virtual std::vector<TagsCompletion>
+  complete(const std::string& prefix, unsigned limit) = 0;
+  virtual std::vector<TagsDeclInfo>
+  find_at(const std::string& pathname, int line_no, int col_no) = 0;
+  virtual std::vector<TagsDeclInfo>
+  find_members(const std::string& scope) = 0;
 };
 
 inline void sql_chk(int return_code) {
@@ -50,6 +244,20 @@ inline void sql_chk(int return_code) {
 #endif
 }
 
+inline std::string sqlite3_column_string(sqlite3_stmt * stmt, int column)
+{
+  const unsigned char * text = sqlite3_column_text(stmt, column);
+  return text ? reinterpret_cast<const char *>(text) : "";
+}
+
+// Version 4 of the schema.  Secondary indexes are kept separately in
+// tags_indexes_sql, so that a bulk load can build them after the data.
+// SourceFiles.tier is the IndexTier the file was last indexed at.
+//
+// Qualified names are stored as a tree of scopes: a SymbolNames row is
+// its parent scope's row, zero at global scope, and its own name in
+// Names, so its full name is its parent's followed by "::" and its name.
+// Each scope's row precedes those of its members.
 const char * tags_sql = "\
 CREATE TABLE SourcePaths (                                              \
     id INTEGER PRIMARY KEY,                                             \
@@ -59,12 +267,6 @@ CREATE TABLE SourcePaths (                                              \
                                                                         \
     FOREIGN KEY(dirname_id) REFERENCES SourcePaths(id)                  \
 );                                                                      \
-CREATE UNIQUE INDEX SourcePaths_id_idx                                  \
-    ON SourcePaths (id);                                                \
-CREATE INDEX SourcePaths_pathname_idx                                   \
-    ON SourcePaths (pathname);                                          \
-CREATE UNIQUE INDEX SourcePaths_all_idx                                 \
-    ON SourcePaths (dirname_id, pathname);                              \
                                                                         \
 CREATE TABLE SourceLines (                                              \
     id INTEGER PRIMARY KEY,                                             \
@@ -75,10 +277,6 @@ CREATE TABLE SourceLines (                                              \
                                                                         \
     FOREIGN KEY(source_path_id) REFERENCES SourcePaths(id)              \
 );                                                                      \
-CREATE UNIQUE INDEX SourceLines_id_idx                                  \
-    ON SourceLines (id);                                                \
-CREATE UNIQUE INDEX SourceLines_all_idx                                 \
-    ON SourceLines (source_path_id, lineno);                            \
                                                                         \
 CREATE TABLE DeclKinds (                                                \
     id INTEGER PRIMARY KEY,                                             \
@@ -93,25 +291,25 @@ INSERT INTO DeclKinds (description) VALUES (\"enum\");                  \
 INSERT INTO DeclKinds (description) VALUES (\"macro\");                 \
 INSERT INTO DeclKinds (description) VALUES (\"namespace\");             \
                                                                         \
+CREATE TABLE Names (                                                    \
+    id INTEGER PRIMARY KEY,                                             \
+                                                                        \
+    name TEXT NOT NULL                                                  \
+);                                                                      \
+                                                                        \
 CREATE TABLE SymbolNames (                                              \
     id INTEGER PRIMARY KEY,                                             \
                                                                         \
-    short_name TEXT NOT NULL,                                           \
-    full_name  TEXT NOT NULL                                            \
+    parent_id INTEGER NOT NULL,                                         \
+    name_id   INTEGER NOT NULL,                                         \
+                                                                        \
+    FOREIGN KEY(name_id) REFERENCES Names(id)                           \
 );                                                                      \
-CREATE UNIQUE INDEX SymbolNames_id_idx                                  \
-    ON SymbolNames (id);                                                \
-CREATE INDEX SymbolNames_short_name_idx                                 \
-    ON SymbolNames (short_name);                                        \
-CREATE UNIQUE INDEX SymbolNames_full_name_idx                           \
-    ON SymbolNames (full_name);                                         \
-CREATE UNIQUE INDEX SymbolNames_all_idx                                 \
-    ON SymbolNames (short_name, full_name);                             \
                                                                         \
 CREATE TABLE Declarations (                                             \
     id INTEGER PRIMARY KEY,                                             \
                                                                         \
-    symbol_name_id         TEXT NOT NULL,                               \
+    symbol_name_id         INTEGER NOT NULL,                            \
     kind_id                INTEGER NOT NULL,                            \
     is_definition          INTEGER NOT NULL,                            \
     is_implicitly_defined  INTEGER NOT NULL,                            \
@@ -119,16 +317,6 @@ CREATE TABLE Declarations (                                             \
     FOREIGN KEY(symbol_name_id) REFERENCES SymbolNames(id),             \
     FOREIGN KEY(kind_id)        REFERENCES DeclKinds(id)                \
 );                                                                      \
-CREATE UNIQUE INDEX Declarations_id_idx                                 \
-    ON Declarations (id);                                               \
-CREATE INDEX Declarations_symbol_name_id_idx                            \
-    ON Declarations (symbol_name_id);                                   \
-CREATE INDEX Declarations_kind_id_idx                                   \
-    ON Declarations (kind_id);                                          \
-CREATE INDEX Declarations_is_definition_idx                             \
-    ON Declarations (is_definition);                                    \
-CREATE INDEX Declarations_all_idx                                       \
-    ON Declarations (symbol_name_id, kind_id, is_definition);           \
                                                                         \
 CREATE TABLE DeclRefKinds (                                             \
     id INTEGER PRIMARY KEY,                                             \
@@ -151,215 +339,1079 @@ CREATE TABLE DeclRefs (                                                 \
                                                                         \
        context_ref_id INTEGER,                                          \
                                                                         \
-       FOREIGN KEY(declaration_id) REFERENCES Entities(id),             \
+       FOREIGN KEY(declaration_id) REFERENCES Declarations(id),         \
        FOREIGN KEY(ref_kind_id)    REFERENCES DeclRefKinds(id),         \
        FOREIGN KEY(source_line_id) REFERENCES SourceLines(id)           \
        FOREIGN KEY(context_ref_id) REFERENCES DeclRefs(id)              \
 );                                                                      \
-CREATE UNIQUE INDEX DeclRefs_id_idx                                     \
-    ON DeclRefs (id);                                                   \
-CREATE INDEX DeclRefs_declaration_id_idx                                \
-    ON DeclRefs (declaration_id);                                       \
-CREATE INDEX DeclRefs_ref_kind_id_idx                                   \
-    ON DeclRefs (ref_kind_id);                                          \
-CREATE INDEX DeclRefs_line_col_idx                                      \
-    ON DeclRefs (source_line_id, colno);                                \
-CREATE INDEX DeclRefs_is_implicit_idx                                   \
-    ON DeclRefs (is_implicit);                                          \
-CREATE INDEX DeclRefs_all_idx                                           \
-    ON DeclRefs (declaration_id, ref_kind_id, source_line_id, colno,    \
-                 is_implicit);                                          \
+                                                                        \
+CREATE TABLE SourceFiles (                                              \
+    source_path_id INTEGER PRIMARY KEY,                                 \
+                                                                        \
+    mtime          INTEGER NOT NULL,                                    \
+    size           INTEGER NOT NULL,                                    \
+    content_hash   INTEGER NOT NULL,                                    \
+    tier           INTEGER NOT NULL DEFAULT 0,                          \
+                                                                        \
+    FOREIGN KEY(source_path_id) REFERENCES SourcePaths(id)              \
+);                                                                      \
+                                                                        \
+CREATE TABLE TranslationUnits (                                         \
+    source_path_id INTEGER PRIMARY KEY,                                 \
+                                                                        \
+    FOREIGN KEY(source_path_id) REFERENCES SourcePaths(id)              \
+);                                                                      \
+                                                                        \
+CREATE TABLE TranslationUnitIncludes (                                  \
+    translation_unit_id INTEGER NOT NULL,                               \
+    source_path_id      INTEGER NOT NULL,                               \
+                                                                        \
+    PRIMARY KEY(translation_unit_id, source_path_id),                   \
+    FOREIGN KEY(translation_unit_id)                                    \
+        REFERENCES TranslationUnits(source_path_id),                    \
+    FOREIGN KEY(source_path_id) REFERENCES SourcePaths(id)              \
+) WITHOUT ROWID;                                                        \
                                                                         \
 CREATE TABLE SchemaInfo (                                               \
        version INTEGER                                                  \
 );                                                                      \
                                                                         \
-INSERT INTO SchemaInfo (version) VALUES (\"1\");";
+INSERT INTO SchemaInfo (version) VALUES (4);";
 
-int query_callback(void *a_param, int argc, char **argv, char **column)
-{
-  assert(argc == 1);
-  *reinterpret_cast<long *>(a_param) = std::atoi(argv[0]);
-  return 0;
-}
+// Every secondary index, each serving a lookup the indexer or a query
+// makes.  Rowid tables need no index on their INTEGER PRIMARY KEY.
+const char * tags_indexes_sql = "\
+CREATE UNIQUE INDEX IF NOT EXISTS SourcePaths_all_idx                   \
+    ON SourcePaths (dirname_id, pathname);                              \
+CREATE INDEX IF NOT EXISTS SourcePaths_pathname_idx                     \
+    ON SourcePaths (pathname);                                          \
+                                                                        \
+CREATE UNIQUE INDEX IF NOT EXISTS SourceLines_all_idx                   \
+    ON SourceLines (source_path_id, lineno);                            \
+                                                                        \
+CREATE UNIQUE INDEX IF NOT EXISTS Names_name_idx                        \
+    ON Names (name);                                                    \
+CREATE INDEX IF NOT EXISTS Names_name_nocase_idx                        \
+    ON Names (name COLLATE NOCASE);                                     \
+                                                                        \
+CREATE UNIQUE INDEX IF NOT EXISTS SymbolNames_parent_name_idx           \
+    ON SymbolNames (parent_id, name_id);                                \
+CREATE INDEX IF NOT EXISTS SymbolNames_name_id_idx                      \
+    ON SymbolNames (name_id);                                           \
+                                                                        \
+CREATE UNIQUE INDEX IF NOT EXISTS Declarations_all_idx                  \
+    ON Declarations (symbol_name_id, kind_id, is_definition,            \
+                     is_implicitly_defined);                            \
+                                                                        \
+CREATE INDEX IF NOT EXISTS DeclRefs_declaration_id_idx                  \
+    ON DeclRefs (declaration_id, ref_kind_id);                          \
+CREATE INDEX IF NOT EXISTS DeclRefs_line_col_decl_idx                   \
+    ON DeclRefs (source_line_id, colno, declaration_id);                \
+                                                                        \
+CREATE INDEX IF NOT EXISTS TranslationUnitIncludes_source_path_id_idx   \
+    ON TranslationUnitIncludes (source_path_id);";
 
-struct SourceLine
-{
-  int source_path_id;
-  int lineno;
+// Drops the indexes in tags_indexes_sql ahead of a bulk load.
+const char * tags_drop_indexes_sql = "\
+DROP INDEX IF EXISTS SourcePaths_all_idx;                               \
+DROP INDEX IF EXISTS SourcePaths_pathname_idx;                          \
+DROP INDEX IF EXISTS SourceLines_all_idx;                               \
+DROP INDEX IF EXISTS Names_name_idx;                                    \
+DROP INDEX IF EXISTS Names_name_nocase_idx;                             \
+DROP INDEX IF EXISTS SymbolNames_parent_name_idx;                       \
+DROP INDEX IF EXISTS SymbolNames_name_id_idx;                           \
+DROP INDEX IF EXISTS Declarations_all_idx;                              \
+DROP INDEX IF EXISTS DeclRefs_declaration_id_idx;                       \
+DROP INDEX IF EXISTS DeclRefs_line_col_decl_idx;                        \
+DROP INDEX IF EXISTS TranslationUnitIncludes_source_path_id_idx;";
 
-  SourceLine(int source_path_id, int lineno)
-    : source_path_id(source_path_id), lineno(lineno) {}
+// Brings a version 1 database to version 2, apart from creating the
+// indexes: adds the tables later version 1 builds created on open, drops
+// the redundant indexes, and rebuilds the tables whose definitions
+// changed.
+const char * migrate_v1_sql = "\
+CREATE TABLE IF NOT EXISTS SourceFiles (                                \
+    source_path_id INTEGER PRIMARY KEY,                                 \
+                                                                        \
+    mtime          INTEGER NOT NULL,                                    \
+    size           INTEGER NOT NULL,                                    \
+    content_hash   INTEGER NOT NULL,                                    \
+                                                                        \
+    FOREIGN KEY(source_path_id) REFERENCES SourcePaths(id)              \
+);                                                                      \
+                                                                        \
+CREATE TABLE IF NOT EXISTS TranslationUnits (                           \
+    source_path_id INTEGER PRIMARY KEY,                                 \
+                                                                        \
+    FOREIGN KEY(source_path_id) REFERENCES SourcePaths(id)              \
+);                                                                      \
+                                                                        \
+CREATE TABLE IF NOT EXISTS TranslationUnitIncludes (                    \
+    translation_unit_id INTEGER NOT NULL,                               \
+    source_path_id      INTEGER NOT NULL                                \
+);                                                                      \
+                                                                        \
+DROP INDEX IF EXISTS SourcePaths_id_idx;                                \
+DROP INDEX IF EXISTS SourceLines_id_idx;                                \
+DROP INDEX IF EXISTS SymbolNames_id_idx;                                \
+DROP INDEX IF EXISTS SymbolNames_short_name_idx;                        \
+DROP INDEX IF EXISTS SymbolNames_all_idx;                               \
+DROP INDEX IF EXISTS Declarations_id_idx;                               \
+DROP INDEX IF EXISTS Declarations_symbol_name_id_idx;                   \
+DROP INDEX IF EXISTS Declarations_kind_id_idx;                          \
+DROP INDEX IF EXISTS Declarations_is_definition_idx;                    \
+DROP INDEX IF EXISTS Declarations_all_idx;                              \
+DROP INDEX IF EXISTS DeclRefs_id_idx;                                   \
+DROP INDEX IF EXISTS DeclRefs_declaration_id_idx;                       \
+DROP INDEX IF EXISTS DeclRefs_ref_kind_id_idx;                          \
+DROP INDEX IF EXISTS DeclRefs_line_col_idx;                             \
+DROP INDEX IF EXISTS DeclRefs_is_implicit_idx;                          \
+DROP INDEX IF EXISTS DeclRefs_all_idx;                                  \
+DROP INDEX IF EXISTS TranslationUnitIncludes_source_path_id_idx;        \
+                                                                        \
+CREATE TABLE Declarations_v2 (                                          \
+    id INTEGER PRIMARY KEY,                                             \
+                                                                        \
+    symbol_name_id         INTEGER NOT NULL,                            \
+    kind_id                INTEGER NOT NULL,                            \
+    is_definition          INTEGER NOT NULL,                            \
+    is_implicitly_defined  INTEGER NOT NULL,                            \
+                                                                        \
+    FOREIGN KEY(symbol_name_id) REFERENCES SymbolNames(id),             \
+    FOREIGN KEY(kind_id)        REFERENCES DeclKinds(id)                \
+);                                                                      \
+INSERT INTO Declarations_v2                                             \
+    SELECT id, CAST(symbol_name_id AS INTEGER), kind_id, is_definition, \
+           is_implicitly_defined                                        \
+      FROM Declarations;                                                \
+DROP TABLE Declarations;                                                \
+ALTER TABLE Declarations_v2 RENAME TO Declarations;                     \
+                                                                        \
+CREATE TABLE TranslationUnitIncludes_v2 (                               \
+    translation_unit_id INTEGER NOT NULL,                               \
+    source_path_id      INTEGER NOT NULL,                               \
+                                                                        \
+    PRIMARY KEY(translation_unit_id, source_path_id),                   \
+    FOREIGN KEY(translation_unit_id)                                    \
+        REFERENCES TranslationUnits(source_path_id),                    \
+    FOREIGN KEY(source_path_id) REFERENCES SourcePaths(id)              \
+) WITHOUT ROWID;                                                        \
+INSERT OR IGNORE INTO TranslationUnitIncludes_v2                        \
+    SELECT translation_unit_id, source_path_id                          \
+      FROM TranslationUnitIncludes;                                     \
+DROP TABLE TranslationUnitIncludes;                                     \
+ALTER TABLE TranslationUnitIncludes_v2                                  \
+    RENAME TO TranslationUnitIncludes;                                  \
+                                                                        \
+UPDATE SchemaInfo SET version = 2;";
 
-  int compare(const SourceLine& right) const {
-    int diff;
-    diff = source_path_id - right.source_path_id;
-    if (!diff)
-      diff = lineno - right.lineno;
-    return diff;
-  }
+// Brings a version 2 database to version 3, in which every file recorded
+// so far was indexed in full.
+const char * migrate_v2_sql = "\
+ALTER TABLE SourceFiles ADD COLUMN tier INTEGER NOT NULL DEFAULT 0;     \
+UPDATE SchemaInfo SET version = 3;";
 
-  bool operator==(const SourceLine& right) const {
-    return compare(right) == 0;
-  }
-  bool operator<(const SourceLine& right) const {
-    return compare(right) < 0;
-  }
-};
-std::map<SourceLine, int> source_lines_map;
+// Brings a version 3 database to version 4, apart from the rows of the new
+// SymbolNames, which SqliteTagsDatabase::migrate_symbol_names adds by
+// splitting each OldSymbolNames.full_name into its scopes, and the
+// remapping of Declarations to them.  Declarations_all_idx is dropped
+// until then, since remapping the rows one by one could briefly collide.
+// The old names are copied rather than renamed, which would rewrite the
+// reference to SymbolNames in Declarations.
+const char * migrate_v3_sql = "\
+DROP INDEX IF EXISTS Declarations_all_idx;                              \
+CREATE TEMPORARY TABLE OldSymbolNames AS                                \
+    SELECT id, short_name, full_name FROM SymbolNames;                  \
+DROP TABLE SymbolNames;                                                 \
+                                                                        \
+CREATE TABLE Names (                                                    \
+    id INTEGER PRIMARY KEY,                                             \
+                                                                        \
+    name TEXT NOT NULL                                                  \
+);                                                                      \
+                                                                        \
+CREATE TABLE SymbolNames (                                              \
+    id INTEGER PRIMARY KEY,                                             \
+                                                                        \
+    parent_id INTEGER NOT NULL,                                         \
+    name_id   INTEGER NOT NULL,                                         \
+                                                                        \
+    FOREIGN KEY(name_id) REFERENCES Names(id)                           \
+);                                                                      \
+                                                                        \
+CREATE UNIQUE INDEX Names_name_idx ON Names (name);                     \
+CREATE UNIQUE INDEX SymbolNames_parent_name_idx                         \
+    ON SymbolNames (parent_id, name_id);                                \
+                                                                        \
+CREATE TEMPORARY TABLE SymbolNameIds (                                  \
+    old_id INTEGER PRIMARY KEY,                                         \
+    new_id INTEGER NOT NULL                                             \
+);";
 
-struct SymbolName
-{
-  std::string short_name;
-  std::string full_name;
+// Finishes what migrate_v3_sql started, once SymbolNameIds is filled in.
+const char * migrate_v3_finish_sql = "\
+UPDATE Declarations SET symbol_name_id =                                \
+    (SELECT new_id FROM SymbolNameIds WHERE old_id = symbol_name_id);   \
+DROP TABLE SymbolNameIds;                                               \
+DROP TABLE OldSymbolNames;                                              \
+UPDATE SchemaInfo SET version = 4;";
 
-  SymbolName(std::string short_name, std::string full_name)
-    : short_name(short_name), full_name(full_name) {}
+const int tags_schema_version = 4;
 
-  int compare(const SymbolName& right) const {
-    int diff;
-    diff = short_name.compare(right.short_name);
-    if (!diff)
-      diff = full_name.compare(right.full_name);
-    return diff;
-  }
+const uint64_t hash_contents_seed = 14695981039346656037ULL;
 
-  bool operator==(const SymbolName& right) const {
-    return compare(right) == 0;
-  }
-  bool operator<(const SymbolName& right) const {
-    return compare(right) < 0;
+// 64-bit FNV-1a, used to recognize source files whose contents have not
+// changed.  HASH may be the result of hashing a preceding chunk.
+inline uint64_t hash_contents(const char * begin, const char * end,
+                              uint64_t hash = hash_contents_seed)
+{
+  for (; begin != end; ++begin) {
+    hash ^= static_cast<unsigned char>(*begin);
+    hash *= 1099511628211ULL;
   }
-};
-std::map<SymbolName, int> symbol_names_map;
+  return hash;
+}
 
-struct TDeclaration
+// Hash the current contents of the file at PATH, returning false if it
+// cannot be read.
+bool hash_file(const std::string& path, uint64_t& hash)
 {
-  int symbol_name_id;
-  int kind_id;
-  int is_definition;
-  int is_implicitly_defined;
+  std::FILE * file = std::fopen(path.c_str(), "rb");
+  if (! file)
+    return false;
 
-  TDeclaration(
-    int symbol_name_id, int kind_id, int is_definition,
-    int is_implicitly_defined)
-    : symbol_name_id(symbol_name_id), kind_id(kind_id),
-      is_definition(is_definition),
-      is_implicitly_defined(is_implicitly_defined) {}
+  char buffer[65536];
+  std::size_t length;
+  hash = hash_contents_seed;
+  while ((length = std::fread(buffer, 1, sizeof buffer, file)) > 0)
+    hash = hash_contents(buffer, buffer + length, hash);
 
-  int compare(const TDeclaration& right) const {
-    int diff;
-    diff = symbol_name_id - right.symbol_name_id;
-    if (!diff)
-      diff = kind_id - right.kind_id;
-    if (!diff)
-      diff = is_definition - right.is_definition;
-    if (!diff)
-      diff = is_implicitly_defined - right.is_implicitly_defined;
-    return diff;
-  }
+  bool ok = ! std::ferror(file);
+  std::fclose(file);
+  return ok;
+}
 
-  bool operator==(const TDeclaration& right) const {
-    return compare(right) == 0;
-  }
-  bool operator<(const TDeclaration& right) const {
-    return compare(right) < 0;
-  }
-};
-std::map<TDeclaration, int> tdeclarations_map;
+// Read the whole of the file at PATH into TEXT, returning false if it
+// cannot be read.
+bool read_file(const std::string& path, std::string& text)
+{
+  std::FILE * file = std::fopen(path.c_str(), "rb");
+  if (! file)
+    return false;
 
-class SqliteTagsDatabase : public TagsDatabase
+  char buffer[65536];
+  std::size_t length;
+  text.clear();
+  while ((length = std::fread(buffer, 1, sizeof buffer, file)) > 0)
+    text.append(buffer, length);
+
+  bool ok = ! std::ferror(file);
+  std::fclose(file);
+  return ok;
+}
+
+// PATH with symbolic links and "." and ".." resolved, or PATH itself if it
+// does not exist.
+std::string canonical_path(const std::string& path)
 {
-  sqlite3 *database;
+  char * resolved = realpath(path.c_str(), NULL);
+  if (! resolved)
+    return path;
+  std::string result(resolved);
+  std::free(resolved);
+  return result;
+}
 
-  std::ostringstream pending_sql;
-  int DeclarationsCounted;
+inline bool is_horizontal_space(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
 
-public:
-  explicit SqliteTagsDatabase(const std::string& path)
-    : DeclarationsCounted(0)
-  {
-#ifdef USE_SQLITE3
-    sql_chk(sqlite3_initialize());
+// The #include directives that TEXT starts with, ignoring blank lines and
+// comments.  ENDS receives the offset of the line after each directive.
+// The scan stops at anything else, including an include of a macro or a
+// line continued with a backslash, so the bytes before each end are
+// exactly the directives up to it and some comments.
+std::vector<std::string> leading_includes(const std::string& text,
+                                          std::vector<std::size_t>& ends)
+{
+  std::vector<std::string> includes;
+  ends.clear();
 
-    bool exists = false;
-    if (access(path.c_str(), R_OK) == 0)
-      exists = true;
+  bool in_comment = false;
+  for (std::size_t line = 0; line < text.size(); ) {
+    std::size_t line_end = text.find('\n', line);
+    std::size_t next     = line_end == std::string::npos ?
+      text.size() : line_end + 1;
+    if (line_end == std::string::npos)
+      line_end = text.size();
 
-#ifdef HAVE_EXCEPTIONS
-    try {
-#endif
-      sql_chk(sqlite3_open(path.c_str(), &database));
+    std::size_t last = line_end;
+    while (last > line && is_horizontal_space(text[last - 1]))
+      --last;
+    if (last > line && text[last - 1] == '\\')
+      return includes;
 
-#ifdef HAVE_EXCEPTIONS
-      try {
-#endif
-        if (! exists) {
-          char * error_msg;
-#ifdef HAVE_EXCEPTIONS
-          try {
-#endif
-            sql_chk(sqlite3_exec(
-                      database, tags_sql, NULL, NULL, &error_msg));
-#ifdef HAVE_EXCEPTIONS
-          }
-          catch (const std::exception& err) {
-            std::cerr << "SQLite3 error: " << error_msg << std::endl;
-            std::cerr << "Error occurred with the following statement: "
-                      << std::endl << tags_sql << std::endl;
-            throw;
-          }
-        }
+    std::string directive;
+    for (std::size_t p = line; p < line_end; ) {
+      if (in_comment) {
+        std::size_t close = text.find("*/", p);
+        if (close == std::string::npos || close + 2 > line_end)
+          break;
+        p = close + 2;
+        in_comment = false;
       }
-      catch (...) {
-        sqlite3_close(database);
+      else if (is_horizontal_space(text[p])) {
+        ++p;
+      }
+      else if (text.compare(p, 2, "//") == 0) {
+        break;
+      }
+      else if (text.compare(p, 2, "/*") == 0) {
+        in_comment = true;
+        p += 2;
+      }
+      else {
+        if (text[p] != '#' || ! directive.empty())
+          return includes;
+        std::size_t q = p + 1;
+        while (q < line_end && is_horizontal_space(text[q]))
+          ++q;
+        if (text.compare(q, 7, "include") != 0)
+          return includes;
+        for (q += 7; q < line_end && is_horizontal_space(text[q]); ++q)
+          ;
+        if (q == line_end || (text[q] != '<' && text[q] != '"'))
+          return includes;
+        std::size_t close = text.find(text[q] == '<' ? '>' : '"', q + 1);
+        if (close == std::string::npos || close >= line_end)
+          return includes;
+        directive = "#include " + text.substr(q, close + 1 - q);
+        p = close + 1;
       }
     }
-    catch (...) {
-      sqlite3_shutdown();
+
+    // The preprocessor must not be started inside a comment.
+    if (! directive.empty()) {
+      if (in_comment)
+        return includes;
+      includes.push_back(directive);
+      ends.push_back(next);
     }
-#endif
-#endif
+    line = next;
   }
+  return includes;
+}
 
-  virtual ~SqliteTagsDatabase() {
-#ifdef USE_SQLITE3
-    std::cerr << std::endl << "Executing batch SQL statements...";
-    sqlite3_void_exec(pending_sql.str().c_str());
-    std::cerr << "done" << std::endl;
+// The identity of the file behind FILE_ENTRY.
+inline TagsFileIdentity file_identity(const FileEntry * file_entry)
+{
+  return TagsFileIdentity(file_entry->getDevice(), file_entry->getInode(),
+                          file_entry->getModificationTime());
+}
 
-    sqlite3_close(database);
-    sqlite3_shutdown();
-#endif
+// The canonical directory and path of every source file seen, so that
+// realpath is called once per file for the whole run rather than once per
+// translation unit including it, and every spelling of a path is stored
+// as the same one.  Shared by every indexing thread.  Entries are never
+// removed, so the strings handed out stay valid until the process exits;
+// a file changed since gets an entry of its own.
+class CanonicalPathCache
+{
+public:
+  struct Entry
+  {
+    std::string dirname;
+    std::string pathname;
+  };
+
+private:
+  pthread_mutex_t                   Lock;
+  std::map<TagsFileIdentity, Entry> Files;
+  std::map<std::string, Entry>      Unidentified;
+
+public:
+  CanonicalPathCache() {
+    pthread_mutex_init(&Lock, NULL);
+  }
+  ~CanonicalPathCache() {
+    pthread_mutex_destroy(&Lock);
   }
 
-  void sqlite3_void_exec(const char * sql)
+  const Entry& lookup(const FileEntry * file_entry)
   {
-    char * error_msg;
-#ifdef HAVE_EXCEPTIONS
-    try {
-#endif
-      sql_chk(sqlite3_exec(database, sql, NULL, NULL, &error_msg));
-#ifdef HAVE_EXCEPTIONS
+    TagsFileIdentity identity(file_identity(file_entry));
+
+    pthread_mutex_lock(&Lock);
+    Entry& entry(identity.known() ? Files[identity] :
+                 Unidentified[file_entry->getName()]);
+    if (entry.pathname.empty()) {
+      entry.pathname = canonical_path(file_entry->getName());
+      std::string::size_type slash = entry.pathname.rfind('/');
+      entry.dirname = slash == std::string::npos ? "." :
+        slash == 0 ? "/" : entry.pathname.substr(0, slash);
     }
-    catch (const std::exception& err) {
-      std::cerr << "SQLite3 error: " << error_msg << std::endl;
-      std::cerr << "Error occurred with the following statement: "
-                << std::endl << sql << std::endl;
-      throw;
+    pthread_mutex_unlock(&Lock);
+    return entry;
+  }
+};
+
+CanonicalPathCache SourcePathCache;
+
+// The set of source files known to be fully indexed, either earlier in this
+// run or by a previous run against the same database.  Files from this run
+// are known by device and inode, so that different spellings of the same
+// path match; files from earlier runs only by their canonical path.
+// Shared by every indexing thread.
+class IndexedFileSet
+{
+  typedef std::pair<dev_t, ino_t> file_identity;
+
+  pthread_mutex_t                                  Lock;
+  std::set<std::pair<file_identity, uint64_t> >    Files;
+  std::map<std::string, uint64_t>                  Previous;
+
+public:
+  IndexedFileSet() {
+    pthread_mutex_init(&Lock, NULL);
+  }
+  ~IndexedFileSet() {
+    pthread_mutex_destroy(&Lock);
+  }
+
+  void add_previous(const std::string& pathname, uint64_t content_hash) {
+    Previous[pathname] = content_hash;
+  }
+
+  bool contains(const FileEntry * file_entry, const std::string& pathname,
+                uint64_t content_hash)
+  {
+    pthread_mutex_lock(&Lock);
+    bool found =
+      Files.count(std::make_pair(identity(file_entry), content_hash)) != 0;
+    if (! found) {
+      std::map<std::string, uint64_t>::const_iterator i =
+        Previous.find(pathname);
+      found = i != Previous.end() && (*i).second == content_hash;
     }
-#endif
+    pthread_mutex_unlock(&Lock);
+    return found;
   }
 
-  long sqlite3_query_for_id(const char * sql)
+  void insert(const FileEntry * file_entry, uint64_t content_hash)
   {
-    char * error_msg;
-#ifdef HAVE_EXCEPTIONS
+    pthread_mutex_lock(&Lock);
+    Files.insert(std::make_pair(identity(file_entry), content_hash));
+    pthread_mutex_unlock(&Lock);
+  }
+
+private:
+  static file_identity identity(const FileEntry * file_entry) {
+    return file_identity(file_entry->getDevice(), file_entry->getInode());
+  }
+};
+
+inline double current_time()
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return now.tv_sec + now.tv_usec / 1e6;
+}
+
+// Write TEXT to OUT as a JSON string.
+void write_json_string(std::ostream& out, const std::string& text)
+{
+  out << '"';
+  for (std::string::const_iterator i = text.begin(); i != text.end(); ++i) {
+    unsigned char c = *i;
+    if (c == '"' || c == '\\')
+      out << '\\' << c;
+    else if (c < 0x20) {
+      char escape[8];
+      std::snprintf(escape, sizeof escape, "\\u%04x", c);
+      out << escape;
+    }
+    else
+      out << c;
+  }
+  out << '"';
+}
+
+// Where the time goes for each translation unit: parsing it, traversing
+// its AST, and handing the records found to the sink.  Shared by every
+// indexing thread, and reported by the database as part of its
+// statistics.
+class IndexStatistics
+{
+public:
+  struct UnitTiming
+  {
+    std::string source;
+    double      parse_seconds;
+    double      traverse_seconds;
+    double      store_seconds;
+    unsigned    records;
+
+    double total() const {
+      return parse_seconds + traverse_seconds + store_seconds;
+    }
+    bool operator<(const UnitTiming& right) const {
+      return total() > right.total();
+    }
+  };
+
+private:
+  static const std::size_t SlowestKept = 10;
+
+  pthread_mutex_t         Lock;
+  double                  Start;
+  unsigned                Units;
+  unsigned long           Records;
+  double                  ParseSeconds;
+  double                  TraverseSeconds;
+  double                  StoreSeconds;
+  double                  MergeSeconds;
+  std::vector<UnitTiming> Slowest;
+
+public:
+  IndexStatistics()
+    : Start(current_time()), Units(0), Records(0), ParseSeconds(0),
+      TraverseSeconds(0), StoreSeconds(0), MergeSeconds(0) {
+    pthread_mutex_init(&Lock, NULL);
+  }
+  ~IndexStatistics() {
+    pthread_mutex_destroy(&Lock);
+  }
+
+  void add_unit(const UnitTiming& unit)
+  {
+    pthread_mutex_lock(&Lock);
+    ++Units;
+    Records         += unit.records;
+    ParseSeconds    += unit.parse_seconds;
+    TraverseSeconds += unit.traverse_seconds;
+    StoreSeconds    += unit.store_seconds;
+
+    if (Slowest.size() < SlowestKept || unit < Slowest.back()) {
+      Slowest.insert(std::upper_bound(Slowest.begin(), Slowest.end(), unit),
+                     unit);
+      if (Slowest.size() > SlowestKept)
+        Slowest.pop_back();
+    }
+    pthread_mutex_unlock(&Lock);
+  }
+
+  // Time spent replaying a worker's buffered records into the database.
+  void add_merge(double seconds)
+  {
+    pthread_mutex_lock(&Lock);
+    MergeSeconds += seconds;
+    pthread_mutex_unlock(&Lock);
+  }
+
+  void write_json(std::ostream& out)
+  {
+    pthread_mutex_lock(&Lock);
+    out << "\"elapsed_seconds\":" << current_time() - Start
+        << ",\"translation_units\":{\"count\":" << Units
+        << ",\"records\":" << Records
+        << ",\"parse_seconds\":" << ParseSeconds
+        << ",\"traverse_seconds\":" << TraverseSeconds
+        << ",\"store_seconds\":" << StoreSeconds
+        << ",\"merge_seconds\":" << MergeSeconds
+        << ",\"slowest\":[";
+    for (std::vector<UnitTiming>::const_iterator i = Slowest.begin();
+         i != Slowest.end();
+         ++i) {
+      if (i != Slowest.begin())
+        out << ",";
+      out << "{\"source\":";
+      write_json_string(out, (*i).source);
+      out << ",\"parse_seconds\":" << (*i).parse_seconds
+          << ",\"traverse_seconds\":" << (*i).traverse_seconds
+          << ",\"store_seconds\":" << (*i).store_seconds
+          << ",\"records\":" << (*i).records << "}";
+    }
+    out << "]}";
+    pthread_mutex_unlock(&Lock);
+  }
+};
+
+// The length of the operator symbol TEXT starts with, if it is one that
+// would otherwise be taken to open or close angle brackets, or zero.
+std::size_t angle_operator_length(llvm::StringRef text)
+{
+  static const char * const symbols[] = {
+    "<<=", ">>=", "->*", "<<", ">>", "<=", ">=", "->", "<", ">"
+  };
+  for (std::size_t i = 0; i < sizeof symbols / sizeof symbols[0]; ++i)
+    if (text.startswith(symbols[i]))
+      return std::strlen(symbols[i]);
+  return 0;
+}
+
+inline bool is_identifier_char(char c)
+{
+  return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+// The position of the first "::" in NAME at or after START that is not
+// within brackets, which template arguments and function parameter lists
+// in a qualified name may contain, or npos if there is none.  The symbol
+// of an operator such as operator<< is not a bracket.
+std::size_t find_scope_separator(llvm::StringRef name, std::size_t start = 0)
+{
+  int depth = 0;
+  for (std::size_t i = start; i + 1 < name.size(); ++i) {
+    char c = name[i];
+    if (c == 'o' && name.substr(i, 8) == "operator" &&
+        (i == 0 || ! is_identifier_char(name[i - 1]))) {
+      std::size_t j = i + 8;
+      while (j < name.size() && name[j] == ' ')
+        ++j;
+      std::size_t length = angle_operator_length(name.substr(j));
+      if (length) {
+        i = j + length - 1;
+        continue;
+      }
+    }
+    if (c == '<' || c == '(' || c == '[')
+      ++depth;
+    else if ((c == '>' || c == ')' || c == ']') && depth > 0)
+      --depth;
+    else if (c == ':' && name[i + 1] == ':' && depth == 0)
+      return i;
+  }
+  return llvm::StringRef::npos;
+}
+
+// The position of the last "::" in NAME that find_scope_separator finds,
+// or npos if there is none.
+std::size_t last_scope_separator(llvm::StringRef name)
+{
+  std::size_t last = llvm::StringRef::npos;
+  for (std::size_t i = find_scope_separator(name);
+       i != llvm::StringRef::npos;
+       i = find_scope_separator(name, i + 2))
+    last = i;
+  return last;
+}
+
+// Keys of the in-memory ID caches, hashed by OpenHashMap.
+
+// A path and the id of the directory it is relative to, zero for the
+// directories themselves.  The path is an id in a StringInterner.
+struct SourcePath
+{
+  int      dirname_id;
+  uint32_t pathname_id;
+
+  SourcePath() : dirname_id(0), pathname_id(0) {}
+  SourcePath(int dirname_id, uint32_t pathname_id)
+    : dirname_id(dirname_id), pathname_id(pathname_id) {}
+
+  uint32_t hash() const {
+    int ints[] = { dirname_id, static_cast<int>(pathname_id) };
+    return hash_ints(ints, 2);
+  }
+
+  bool operator==(const SourcePath& right) const {
+    return (dirname_id == right.dirname_id &&
+            pathname_id == right.pathname_id);
+  }
+};
+
+struct SourceLine
+{
+  int source_path_id;
+  int lineno;
+
+  SourceLine() : source_path_id(0), lineno(0) {}
+  SourceLine(int source_path_id, int lineno)
+    : source_path_id(source_path_id), lineno(lineno) {}
+
+  uint32_t hash() const {
+    int ints[] = { source_path_id, lineno };
+    return hash_ints(ints, 2);
+  }
+
+  bool operator==(const SourceLine& right) const {
+    return (source_path_id == right.source_path_id &&
+            lineno == right.lineno);
+  }
+};
+
+// A symbol's enclosing scope, zero at global scope, and its own name, as
+// IDs in SymbolNames and Names.
+struct SymbolName
+{
+  int parent_id;
+  int name_id;
+
+  SymbolName() : parent_id(0), name_id(0) {}
+  SymbolName(int parent_id, int name_id)
+    : parent_id(parent_id), name_id(name_id) {}
+
+  uint32_t hash() const {
+    int ints[] = { parent_id, name_id };
+    return hash_ints(ints, 2);
+  }
+
+  bool operator==(const SymbolName& right) const {
+    return (parent_id == right.parent_id && name_id == right.name_id);
+  }
+};
+
+struct TDeclaration
+{
+  int symbol_name_id;
+  int kind_id;
+  int is_definition;
+  int is_implicitly_defined;
+
+  TDeclaration()
+    : symbol_name_id(0), kind_id(0), is_definition(0),
+      is_implicitly_defined(0) {}
+  TDeclaration(
+    int symbol_name_id, int kind_id, int is_definition,
+    int is_implicitly_defined)
+    : symbol_name_id(symbol_name_id), kind_id(kind_id),
+      is_definition(is_definition),
+      is_implicitly_defined(is_implicitly_defined) {}
+
+  uint32_t hash() const {
+    int ints[] = { symbol_name_id, kind_id, is_definition,
+                   is_implicitly_defined };
+    return hash_ints(ints, 4);
+  }
+
+  bool operator==(const TDeclaration& right) const {
+    return (symbol_name_id == right.symbol_name_id &&
+            kind_id == right.kind_id &&
+            is_definition == right.is_definition &&
+            is_implicitly_defined == right.is_implicitly_defined);
+  }
+};
+
+// A reference, which merging shards needs to recognize: DeclRefs has no
+// unique index, since the indexer never stores one twice itself.
+struct DeclRefKey
+{
+  int declaration_id;
+  int ref_kind_id;
+  int source_line_id;
+  int colno;
+
+  DeclRefKey() : declaration_id(0), ref_kind_id(0), source_line_id(0),
+                 colno(0) {}
+  DeclRefKey(int declaration_id, int ref_kind_id, int source_line_id,
+             int colno)
+    : declaration_id(declaration_id), ref_kind_id(ref_kind_id),
+      source_line_id(source_line_id), colno(colno) {}
+
+  uint32_t hash() const {
+    int ints[] = { declaration_id, ref_kind_id, source_line_id, colno };
+    return hash_ints(ints, 4);
+  }
+
+  bool operator==(const DeclRefKey& right) const {
+    return (declaration_id == right.declaration_id &&
+            ref_kind_id == right.ref_kind_id &&
+            source_line_id == right.source_line_id &&
+            colno == right.colno);
+  }
+};
+
+// The layout of the read-only index written by 'export' and mapped by
+// MappedTagsDatabase.  Every record has a fixed width and every string is
+// an offset into a pool of NUL-terminated strings, so a query reads the
+// file in place.  Integers are in host byte order; an index is only meant
+// to be read on the machine that wrote it.
+const char     mapped_index_magic[8] = "CLTAGSX";
+const uint32_t mapped_index_version  = 1;
+
+struct MappedIndexHeader
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t symbol_count;
+  uint32_t ref_count;
+  uint32_t file_count;
+  uint64_t strings_offset;
+  uint64_t strings_size;
+  uint64_t files_offset;         // MappedFile[file_count + 1]
+  uint64_t symbols_offset;       // MappedSymbol[symbol_count]
+  uint64_t by_short_name_offset; // uint32_t[symbol_count]
+  uint64_t refs_offset;          // MappedRef[ref_count]
+  uint64_t by_position_offset;   // uint32_t[ref_count]
+};
+
+// Files are sorted by path name.  FIRST_POSITION indexes the by-position
+// array, which lists the file's references in line and column order; a
+// final entry marks the end of the last file's.
+struct MappedFile
+{
+  uint32_t pathname;
+  uint32_t first_position;
+};
+
+// Symbols are sorted by full name, and the first bytes of the name are
+// kept inline so that most probes of a binary search never touch the
+// string pool.  A symbol's references are contiguous, its declarations and
+// definitions first, then its uses.  Bit N of KINDS is set if the symbol
+// was declared with DeclKinds id N.
+struct MappedSymbol
+{
+  char     prefix[8];
+  uint32_t full_name;
+  uint32_t short_name;
+  uint32_t first_ref;
+  uint32_t declaration_count;
+  uint32_t use_count;
+  uint32_t kinds;
+};
+
+struct MappedRef
+{
+  uint32_t symbol;
+  uint32_t file;
+  uint32_t line_no;
+  uint32_t col_no;
+  uint32_t text;
+};
+
+const char * const decl_kind_names[] = {
+  "", "function", "type", "variable", "enum", "macro", "namespace"
+};
+const uint32_t decl_kind_count =
+  sizeof decl_kind_names / sizeof decl_kind_names[0];
+
+inline unsigned char fold_case(unsigned char c) {
+  return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+// Compare the first LENGTH bytes of LEFT and RIGHT ignoring ASCII case, as
+// SQLite's NOCASE collation does.
+inline int compare_nocase(const char * left, const char * right,
+                          std::size_t length)
+{
+  for (std::size_t i = 0; i < length; ++i) {
+    int diff = fold_case(left[i]) - fold_case(right[i]);
+    if (diff)
+      return diff;
+  }
+  return 0;
+}
+
+// Appends the sections of an index file, keeping track of where each one
+// starts.
+class MappedIndexWriter
+{
+  std::FILE * file;
+  uint64_t    offset;
+  uint64_t    strings_offset;
+
+public:
+  explicit MappedIndexWriter(std::FILE * file)
+    : file(file), offset(0), strings_offset(0) {}
+
+  uint64_t position() const {
+    return offset;
+  }
+
+  void write(const void * data, std::size_t length)
+  {
+    if (length && std::fwrite(data, 1, length, file) != length)
+      llvm::report_fatal_error("Cannot write the exported index");
+    offset += length;
+  }
+
+  void align()
+  {
+    static const char padding[8] = { 0 };
+    write(padding, (8 - offset % 8) % 8);
+  }
+
+  void begin_strings() {
+    strings_offset = offset;
+  }
+
+  // Add TEXT to the string pool, returning its offset there.
+  uint32_t add_string(const char * text, std::size_t length)
+  {
+    uint64_t string_offset = offset - strings_offset;
+    if (string_offset + length + 1 > 0xffffffffULL)
+      llvm::report_fatal_error("Too much text for an exported index");
+    write(text, length);
+    write("", 1);
+    return static_cast<uint32_t>(string_offset);
+  }
+
+  template <typename T>
+  uint64_t write_array(const std::vector<T>& items)
+  {
+    align();
+    uint64_t start = offset;
+    if (! items.empty())
+      write(&items[0], items.size() * sizeof(T));
+    return start;
+  }
+};
+
+
+class SqliteTagsDatabase : public TagsDatabase
+{
+  sqlite3 *database;
+
+  // Prepared statements are keyed by the address of their SQL text, which
+  // is always a string literal, so each distinct statement is prepared only
+  // once per database handle and then reset and rebound on every use.
+  typedef std::map<const char *, sqlite3_stmt *> statements_map;
+  statements_map statements;
+
+  // Caches of the IDs already assigned in this database.  Paths and symbol
+  // names are interned, so each distinct string is held in memory once.
+  // When CachesComplete is set the caches hold every row of their tables,
+  // either because the database was just created or because they were
+  // preloaded, and a miss means the row must be inserted without first
+  // looking for it.  The files seen while indexing are also cached by
+  // identity, which is never preloaded since it is not stored.
+  StringInterner                cache_strings;
+  OpenHashMap<SourcePath>       source_paths_map;
+  OpenHashMap<TagsFileIdentity> file_paths_map;
+  OpenHashMap<SourceLine>       source_lines_map;
+  std::vector<int>              name_ids;
+  OpenHashMap<SymbolName>       symbol_names_map;
+  OpenHashMap<TDeclaration>     tdeclarations_map;
+  bool                          CachesComplete;
+
+  // The scope of the last symbol stored, and its ID, since declarations
+  // mostly arrive grouped by scope.
+  std::string                 LastScope;
+  long                        LastScopeId;
+
+  // Writes are grouped into explicit transactions, each committed once
+  // BatchRows rows or BatchBytes bytes have been written, so that neither
+  // memory use nor the work lost if the process dies grows with the size
+  // of the project.
+  bool        InTransaction;
+  unsigned    BatchRows;
+  std::size_t BatchBytes;
+  unsigned    PendingRows;
+  std::size_t PendingBytes;
+
+  int DeclarationsCounted;
+  int StatementsPrepared;
+  int StatementsReused;
+  int TransactionsCommitted;
+
+  // Counters for the statistics report, which is written when requested
+  // and every ReportInterval seconds while indexing if that is non-zero.
+  struct CacheCounter
+  {
+    unsigned long hits;
+    unsigned long misses;
+
+    CacheCounter() : hits(0), misses(0) {}
+    void count(bool hit) {
+      ++(hit ? hits : misses);
+    }
+  };
+
+  CacheCounter      SourcePathsCounter;
+  CacheCounter      SourceLinesCounter;
+  CacheCounter      SymbolNamesCounter;
+  CacheCounter      DeclarationsCounter;
+  unsigned long     RowsWritten;
+  unsigned long     ReferencesCounted;
+  unsigned long long BytesWritten;
+  double            SqliteSeconds;
+  IndexStatistics * Statistics;
+  double            ReportInterval;
+  double            NextReport;
+
+public:
+  explicit SqliteTagsDatabase(const std::string& path)
+    : CachesComplete(false), LastScopeId(0), InTransaction(false),
+      BatchRows(100000),
+      BatchBytes(64 << 20),
+      PendingRows(0), PendingBytes(0), DeclarationsCounted(0),
+      StatementsPrepared(0), StatementsReused(0), TransactionsCommitted(0),
+      RowsWritten(0), ReferencesCounted(0), BytesWritten(0),
+      SqliteSeconds(0), Statistics(NULL), ReportInterval(0), NextReport(0)
+  {
+    sql_chk(sqlite3_initialize());
+
+    bool exists = false;
+    if (access(path.c_str(), R_OK) == 0)
+      exists = true;
+    CachesComplete = ! exists;
+
+#ifdef HAVE_EXCEPTIONS
+    try {
+#endif
+      sql_chk(sqlite3_open(path.c_str(), &database));
+
+#ifdef HAVE_EXCEPTIONS
+      try {
+#endif
+        if (! exists) {
+          char * error_msg;
+#ifdef HAVE_EXCEPTIONS
+          try {
+#endif
+            sql_chk(sqlite3_exec(
+                      database, tags_sql, NULL, NULL, &error_msg));
+#ifdef HAVE_EXCEPTIONS
+          }
+          catch (const std::exception& err) {
+            std::cerr << "SQLite3 error: " << error_msg << std::endl;
+            std::cerr << "Error occurred with the following statement: "
+                      << std::endl << tags_sql << std::endl;
+            throw;
+          }
+        }
+
+        if (! exists)
+          sqlite3_void_exec(tags_indexes_sql);
+        else
+          upgrade_schema();
+
+        sqlite3_void_exec("PRAGMA journal_mode = WAL;");
+        sqlite3_void_exec("PRAGMA synchronous = NORMAL;");
+        sqlite3_void_exec("PRAGMA cache_size = -65536;");
+        sqlite3_void_exec("PRAGMA temp_store = MEMORY;");
+      }
+      catch (...) {
+        sqlite3_close(database);
+      }
+    }
+    catch (...) {
+      sqlite3_shutdown();
+    }
+#endif
+  }
+
+  virtual ~SqliteTagsDatabase() {
+    commit_batch();
+    if (DeclarationsCounted > 0)
+      std::cerr << std::endl;
+
+    for (statements_map::iterator i = statements.begin();
+         i != statements.end();
+         ++i)
+      sqlite3_finalize((*i).second);
+
+    sqlite3_close(database);
+    sqlite3_shutdown();
+  }
+
+  void sqlite3_void_exec(const char * sql)
+  {
+    char * error_msg;
+#ifdef HAVE_EXCEPTIONS
     try {
 #endif
-      long id = -1;
-      sql_chk(sqlite3_exec(database, sql, query_callback, &id, &error_msg));
-      return id;
+      sql_chk(sqlite3_exec(database, sql, NULL, NULL, &error_msg));
 #ifdef HAVE_EXCEPTIONS
     }
     catch (const std::exception& err) {
@@ -371,333 +1423,4020 @@ public:
 #endif
   }
 
-  long sqlite3_insert_new(const char * sql)
+  // Bring a database written by an earlier version up to date, as one
+  // transaction so that an interrupted upgrade is simply redone.
+  void upgrade_schema()
+  {
+    int version = 1;
+    sqlite3_stmt * stmt = sqlite3_prepare_cached(
+      "SELECT version FROM SchemaInfo");
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+      version = sqlite3_column_int(stmt, 0);
+    sqlite3_reset(stmt);
+
+    if (version > tags_schema_version)
+      llvm::report_fatal_error("CLTAGS was written by a newer clang-tags");
+    if (version == tags_schema_version)
+      return;
+
+    std::cerr << "Upgrading CLTAGS from schema version " << version
+              << " to " << tags_schema_version << std::endl;
+    sqlite3_void_exec("BEGIN TRANSACTION;");
+    if (version < 2)
+      sqlite3_void_exec(migrate_v1_sql);
+    if (version < 3)
+      sqlite3_void_exec(migrate_v2_sql);
+    sqlite3_void_exec(migrate_v3_sql);
+    migrate_symbol_names();
+    sqlite3_void_exec(migrate_v3_finish_sql);
+    sqlite3_void_exec(tags_indexes_sql);
+    sqlite3_void_exec("COMMIT TRANSACTION;");
+  }
+
+  // Store every name in OldSymbolNames as a tree of scopes, recording the
+  // new ID of each in SymbolNameIds.  The new tables start out empty, so
+  // their caches are complete while this runs.
+  void migrate_symbol_names()
+  {
+    bool caches_complete = CachesComplete;
+    CachesComplete = true;
+
+    sqlite3_stmt * stmt = sqlite3_prepare_cached(
+      "SELECT id, short_name, full_name FROM OldSymbolNames ORDER BY id");
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      long id = symbol_name(sqlite3_column_string(stmt, 1),
+                            sqlite3_column_string(stmt, 2));
+
+      sqlite3_stmt * insert = sqlite3_prepare_cached(
+        "INSERT INTO SymbolNameIds (old_id, new_id) VALUES (?, ?);");
+      sql_chk(sqlite3_bind_int(insert, 1, sqlite3_column_int(stmt, 0)));
+      sql_chk(sqlite3_bind_int(insert, 2, static_cast<int>(id)));
+      sqlite3_step_for_id(insert);
+    }
+    sqlite3_reset(stmt);
+
+    CachesComplete = caches_complete;
+  }
+
+  bool caches_complete() const {
+    return CachesComplete;
+  }
+
+  // A bulk load drops the secondary indexes and builds them again once
+  // the data is in, which is much cheaper than updating them row by row.
+  // Nothing may look rows up in between, so the caches must be complete.
+  void drop_indexes()
+  {
+    commit_batch();
+    sqlite3_void_exec(tags_drop_indexes_sql);
+  }
+
+  // Within the current transaction, if any, so that an update can make
+  // sure of the indexes without exposing its deletions.
+  void create_indexes()
+  {
+    sqlite3_void_exec(tags_indexes_sql);
+  }
+
+  void set_batch_limits(unsigned rows, std::size_t bytes) {
+    BatchRows  = rows;
+    BatchBytes = bytes;
+  }
+
+  // Make sure the writes that follow happen inside a transaction.
+  void begin_batch()
+  {
+    if (! InTransaction) {
+      sqlite3_void_exec("BEGIN TRANSACTION;");
+      InTransaction = true;
+    }
+  }
+
+  void commit_batch()
+  {
+    if (InTransaction) {
+      sqlite3_void_exec("COMMIT TRANSACTION;");
+      InTransaction = false;
+      ++TransactionsCommitted;
+    }
+    PendingRows  = 0;
+    PendingBytes = 0;
+  }
+
+  // Account for a row of roughly BYTES bytes just written, committing the
+  // current transaction and starting the next if it is now big enough.
+  void row_written(std::size_t bytes)
+  {
+    ++PendingRows;
+    PendingBytes += bytes;
+    ++RowsWritten;
+    BytesWritten += bytes;
+    if (PendingRows >= BatchRows || PendingBytes >= BatchBytes) {
+      commit_batch();
+      begin_batch();
+    }
+  }
+
+  sqlite3_stmt * sqlite3_prepare_cached(const char * sql)
+  {
+    statements_map::iterator i = statements.find(sql);
+    if (i != statements.end()) {
+      ++StatementsReused;
+      return (*i).second;
+    }
+
+    sqlite3_stmt * stmt;
+#ifdef HAVE_EXCEPTIONS
+    try {
+#endif
+      sql_chk(sqlite3_prepare_v2(database, sql, -1, &stmt, NULL));
+#ifdef HAVE_EXCEPTIONS
+    }
+    catch (const std::exception& err) {
+      std::cerr << "SQLite3 error: " << sqlite3_errmsg(database) << std::endl;
+      std::cerr << "Error occurred preparing the following statement: "
+                << std::endl << sql << std::endl;
+      throw;
+    }
+#endif
+    ++StatementsPrepared;
+    statements.insert(std::make_pair(sql, stmt));
+    return stmt;
+  }
+
+  // Bind the variadic arguments to STMT according to PARAM_TYPES, which
+  // holds one character per parameter: 'i' for an int, 'l' for a long
+  // long, 's' for a NUL-terminated string, 't' for a string of known
+  // length passed as a const char * and an int.  Arguments beyond the
+  // statement's own parameters are ignored, so that a SELECT can share the
+  // argument list of its INSERT.  Returns the number of bytes bound.
+  std::size_t sqlite3_bind_params(sqlite3_stmt * stmt,
+                                  const char * param_types, va_list argslist)
+  {
+    std::size_t bytes = 0;
+    int count = sqlite3_bind_parameter_count(stmt);
+    for (int index = 1; *param_types && index <= count;
+         ++param_types, ++index) {
+      switch (*param_types) {
+      case 'i':
+        sql_chk(sqlite3_bind_int(stmt, index, va_arg(argslist, int)));
+        bytes += sizeof(int);
+        break;
+      case 'l':
+        sql_chk(sqlite3_bind_int64(stmt, index,
+                                   va_arg(argslist, long long)));
+        bytes += sizeof(long long);
+        break;
+      case 's': {
+        const char * text = va_arg(argslist, const char *);
+        sql_chk(sqlite3_bind_text(stmt, index, text, -1, SQLITE_STATIC));
+        bytes += std::strlen(text);
+        break;
+      }
+      case 't': {
+        const char * text   = va_arg(argslist, const char *);
+        int          length = va_arg(argslist, int);
+        sql_chk(sqlite3_bind_text(stmt, index, text, length, SQLITE_STATIC));
+        bytes += length;
+        break;
+      }
+      default:
+        assert(! "unknown SQL parameter type");
+        break;
+      }
+    }
+    return bytes;
+  }
+
+  // Step STMT to completion, returning the first column of its first row
+  // (or -1 if there were no rows), then make it ready for the next use.
+  long sqlite3_step_for_id(sqlite3_stmt * stmt)
+  {
+    long id = -1;
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+      id = static_cast<long>(sqlite3_column_int64(stmt, 0));
+      rc = sqlite3_step(stmt);
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+#ifdef HAVE_EXCEPTIONS
+    if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
+      std::cerr << "SQLite3 error: " << sqlite3_errmsg(database) << std::endl;
+      std::cerr << "Error occurred with the following statement: "
+                << std::endl << sqlite3_sql(stmt) << std::endl;
+      throw std::runtime_error("SQLite3 call failed");
+    }
+#endif
+    return id;
+  }
+
+  // Return the id of the row found by SELECT_SQL, or of the one inserted by
+  // INSERT_SQL if there is none.  With complete caches the caller already
+  // knows there is none, so the SELECT is skipped.
+  long sqlite3_insert_maybe(const char * select_sql, const char * insert_sql,
+                            const char * param_types, ...)
+  {
+    va_list argslist;
+    sqlite3_stmt * stmt;
+    long id = -1;
+
+    if (! CachesComplete) {
+      stmt = sqlite3_prepare_cached(select_sql);
+      va_start(argslist, param_types);
+      sqlite3_bind_params(stmt, param_types, argslist);
+      va_end(argslist);
+      id = sqlite3_step_for_id(stmt);
+    }
+
+    if (id == -1) {
+      stmt = sqlite3_prepare_cached(insert_sql);
+      va_start(argslist, param_types);
+      std::size_t bytes = sqlite3_bind_params(stmt, param_types, argslist);
+      va_end(argslist);
+      sqlite3_step_for_id(stmt);
+      id = static_cast<long>(sqlite3_last_insert_rowid(database));
+      row_written(bytes);
+    }
+    return id;
+  }
+
+  // Include STATISTICS in reports, writing one to stderr every INTERVAL
+  // seconds while indexing if INTERVAL is non-zero.
+  void set_statistics(IndexStatistics * statistics, double interval)
+  {
+    Statistics     = statistics;
+    ReportInterval = interval;
+    NextReport     = current_time() + interval;
+  }
+
+  // Write the statistics as a single line of JSON.
+  void report_statistics(std::ostream& out)
+  {
+    out << "{";
+    if (Statistics) {
+      Statistics->write_json(out);
+      out << ",";
+    }
+    out << "\"database\":{\"declarations\":" << DeclarationsCounted
+        << ",\"references\":" << ReferencesCounted
+        << ",\"rows_written\":" << RowsWritten
+        << ",\"bytes_written\":" << BytesWritten
+        << ",\"sqlite_seconds\":" << SqliteSeconds
+        << ",\"statements_prepared\":" << StatementsPrepared
+        << ",\"statements_executed\":"
+        << StatementsPrepared + StatementsReused
+        << ",\"transactions_committed\":" << TransactionsCommitted
+        << ",\"cache_bytes\":" << cache_memory_usage()
+        << ",\"caches\":{";
+    write_counter(out, "source_paths", SourcePathsCounter);
+    out << ",";
+    write_counter(out, "source_lines", SourceLinesCounter);
+    out << ",";
+    write_counter(out, "symbol_names", SymbolNamesCounter);
+    out << ",";
+    write_counter(out, "declarations", DeclarationsCounter);
+    out << "}}}" << std::endl;
+  }
+
+  static void write_counter(std::ostream& out, const char * name,
+                            const CacheCounter& counter)
+  {
+    out << "\"" << name << "\":{\"hits\":" << counter.hits
+        << ",\"misses\":" << counter.misses << "}";
+  }
+
+  void maybe_report_statistics()
+  {
+    if (ReportInterval > 0) {
+      double now = current_time();
+      if (now >= NextReport) {
+        report_statistics(std::cerr);
+        NextReport = now + ReportInterval;
+      }
+    }
+  }
+
+  std::size_t cache_memory_usage() const
+  {
+    return (cache_strings.memory_usage() + source_paths_map.memory_usage() +
+            file_paths_map.memory_usage() + source_lines_map.memory_usage() +
+            name_ids.capacity() * sizeof(int) +
+            symbol_names_map.memory_usage() +
+            tdeclarations_map.memory_usage());
+  }
+
+  // Fill the ID caches from the existing tables, one sequential scan per
+  // table, so that indexing into a populated database never has to look
+  // up a row before inserting it.
+  void preload_caches()
+  {
+    if (CachesComplete)
+      return;
+
+    sqlite3_stmt * stmt = sqlite3_prepare_cached(
+      "SELECT id, dirname_id, pathname FROM SourcePaths");
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+      source_paths_map.insert(
+        SourcePath(sqlite3_column_int(stmt, 1),
+                   intern_column(stmt, 2)), sqlite3_column_int(stmt, 0));
+    sqlite3_reset(stmt);
+
+    preload_source_lines();
+
+    stmt = sqlite3_prepare_cached("SELECT id, name FROM Names");
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+      set_name_id(intern_column(stmt, 1), sqlite3_column_int(stmt, 0));
+    sqlite3_reset(stmt);
+
+    stmt = sqlite3_prepare_cached(
+      "SELECT id, parent_id, name_id FROM SymbolNames");
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+      symbol_names_map.insert(
+        SymbolName(sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2)),
+        sqlite3_column_int(stmt, 0));
+    sqlite3_reset(stmt);
+
+    stmt = sqlite3_prepare_cached(
+      "SELECT id, symbol_name_id, kind_id, is_definition, \
+              is_implicitly_defined FROM Declarations");
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+      tdeclarations_map.insert(
+        TDeclaration(sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2),
+                     sqlite3_column_int(stmt, 3), sqlite3_column_int(stmt, 4)),
+        sqlite3_column_int(stmt, 0));
+    sqlite3_reset(stmt);
+
+    CachesComplete = true;
+
+    std::cerr << "Preloaded " << source_paths_map.size() << " paths, "
+              << source_lines_map.size() << " lines, "
+              << symbol_names_map.size() << " symbols and "
+              << tdeclarations_map.size() << " declarations ("
+              << cache_memory_usage() / 1024 << " KB)" << std::endl;
+  }
+
+  void preload_source_lines()
+  {
+    sqlite3_stmt * stmt = sqlite3_prepare_cached(
+      "SELECT id, source_path_id, lineno FROM SourceLines");
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+      source_lines_map.insert(
+        SourceLine(sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2)),
+        sqlite3_column_int(stmt, 0));
+    sqlite3_reset(stmt);
+  }
+
+  uint32_t intern_column(sqlite3_stmt * stmt, int column)
+  {
+    const unsigned char * text = sqlite3_column_text(stmt, column);
+    return cache_strings.intern(reinterpret_cast<const char *>(text),
+                                sqlite3_column_bytes(stmt, column));
+  }
+
+  long source_directory(llvm::StringRef dirname)
+  {
+    SourcePath dirname_path(
+      0, cache_strings.intern(dirname.data(), dirname.size()));
+    int * dirname_i = source_paths_map.find(dirname_path);
+    SourcePathsCounter.count(dirname_i);
+    if (dirname_i)
+      return *dirname_i;
+
+    long source_path_dirname_id =
+      sqlite3_insert_maybe(
+        "SELECT id FROM SourcePaths WHERE pathname = ?",
+        "INSERT INTO SourcePaths (pathname) VALUES (?);",
+        "t", dirname.data(), static_cast<int>(dirname.size()));
+
+    source_paths_map.insert(dirname_path, source_path_dirname_id);
+    return source_path_dirname_id;
+  }
+
+  // The ID of the file FILE, whose path is PATHNAME in DIRNAME.  Once a
+  // file is known by identity it is found by that alone, without hashing
+  // or even reading its path.
+  long source_path(const TagsFileIdentity& file, llvm::StringRef dirname,
+                   llvm::StringRef pathname)
+  {
+    if (! file.known())
+      return source_path(dirname, pathname);
+
+    int * source_path_i = file_paths_map.find(file);
+    SourcePathsCounter.count(source_path_i);
+    if (source_path_i)
+      return *source_path_i;
+
+    long source_path_id = source_path(dirname, pathname);
+    file_paths_map.insert(file, source_path_id);
+    return source_path_id;
+  }
+
+  long source_path(llvm::StringRef dirname, llvm::StringRef pathname)
+  {
+    long source_path_dirname_id = source_directory(dirname);
+
+    SourcePath source_path(
+      source_path_dirname_id,
+      cache_strings.intern(pathname.data(), pathname.size()));
+    int * source_path_i = source_paths_map.find(source_path);
+    SourcePathsCounter.count(source_path_i);
+    if (source_path_i)
+      return *source_path_i;
+
+    long source_path_id =
+      sqlite3_insert_maybe(
+        "SELECT id FROM SourcePaths WHERE dirname_id = ? AND pathname = ?",
+        "INSERT INTO SourcePaths (dirname_id, pathname) VALUES (?, ?);",
+        "it", static_cast<int>(source_path_dirname_id), pathname.data(),
+        static_cast<int>(pathname.size()));
+
+    source_paths_map.insert(source_path, source_path_id);
+    return source_path_id;
+  }
+
+  // Record that the file RECORD describes was indexed at TIER.  A file whose
+  // contents are unchanged keeps the more complete of its old and new
+  // tiers, since a --fast run skips the files indexed in full before.
+  long store_source_file(const TagsFileRecord& record, IndexTier tier)
+  {
+    long source_path_id =
+      source_path(record.file, record.dirname, record.pathname);
+    store_source_file(source_path_id, record.mtime, record.size,
+                      record.content_hash, tier);
+    return source_path_id;
+  }
+
+  void store_source_file(long source_path_id, long long mtime,
+                         long long size, uint64_t content_hash, int tier)
+  {
+    sqlite3_stmt * stmt = sqlite3_prepare_cached(
+      "INSERT OR REPLACE INTO SourceFiles \
+           (source_path_id, mtime, size, content_hash, tier) \
+           VALUES (?1, ?2, ?3, ?4, \
+                   MIN(?5, IFNULL((SELECT tier FROM SourceFiles \
+                                    WHERE source_path_id = ?1 \
+                                      AND content_hash = ?4), ?5)));");
+    sql_chk(sqlite3_bind_int(stmt, 1, static_cast<int>(source_path_id)));
+    sql_chk(sqlite3_bind_int64(stmt, 2, mtime));
+    sql_chk(sqlite3_bind_int64(stmt, 3, size));
+    sql_chk(sqlite3_bind_int64(
+              stmt, 4, static_cast<sqlite3_int64>(content_hash)));
+    sql_chk(sqlite3_bind_int(stmt, 5, tier));
+    sqlite3_step_for_id(stmt);
+    row_written(5 * sizeof(sqlite3_int64));
+  }
+
+  virtual void add_translation_unit(const TagsTranslationUnitRecord& record)
+  {
+    double start = Statistics ? current_time() : 0;
+    begin_batch();
+
+    long unit_id = store_source_file(record.main_file, record.tier);
+
+    sqlite3_stmt * stmt = sqlite3_prepare_cached(
+      "INSERT OR IGNORE INTO TranslationUnits (source_path_id) VALUES (?);");
+    sql_chk(sqlite3_bind_int(stmt, 1, static_cast<int>(unit_id)));
+    sqlite3_step_for_id(stmt);
+
+    stmt = sqlite3_prepare_cached(
+      "DELETE FROM TranslationUnitIncludes WHERE translation_unit_id = ?;");
+    sql_chk(sqlite3_bind_int(stmt, 1, static_cast<int>(unit_id)));
+    sqlite3_step_for_id(stmt);
+
+    for (std::vector<TagsFileRecord>::const_iterator i =
+           record.included_files.begin();
+         i != record.included_files.end();
+         ++i) {
+      long source_path_id = store_source_file(*i, record.tier);
+
+      stmt = sqlite3_prepare_cached(
+        "INSERT OR IGNORE INTO TranslationUnitIncludes \
+             (translation_unit_id, source_path_id) VALUES (?, ?);");
+      sql_chk(sqlite3_bind_int(stmt, 1, static_cast<int>(unit_id)));
+      sql_chk(sqlite3_bind_int(stmt, 2, static_cast<int>(source_path_id)));
+      sqlite3_step_for_id(stmt);
+      row_written(2 * sizeof(int));
+    }
+    if (Statistics)
+      SqliteSeconds += current_time() - start;
+
+    // Every mode adds each translation unit here, on the thread that owns
+    // the database, so this is where periodic reports are made.
+    maybe_report_statistics();
+  }
+
+  void execute_for_id(const char * sql, long id)
+  {
+    sqlite3_stmt * stmt = sqlite3_prepare_cached(sql);
+    sql_chk(sqlite3_bind_int(stmt, 1, static_cast<int>(id)));
+    sqlite3_step_for_id(stmt);
+  }
+
+  // Find the translation units that must be re-indexed because their own
+  // source or any file they include has changed since it was indexed, or
+  // with UPGRADE was only indexed at a lesser tier than in full.  The changed
+  // files' stale rows are deleted, as are the upgraded files' references
+  // (their lines stay, so their IDs do too), every other file is added to
+  // UNCHANGED, and the paths of the affected translation units are
+  // returned.  Translation units whose source no longer exists are dropped.
+  // With CANDIDATES only the files named there are looked at for changes,
+  // and the rest are taken to be unchanged.
+  std::vector<std::string>
+  prepare_update(IndexedFileSet& unchanged, bool upgrade,
+                 const std::set<std::string> * candidates = NULL)
+  {
+    std::set<long> changed;
+    std::set<long> removed;
+    std::set<long> upgraded;
+
+    begin_batch();
+
+    sqlite3_stmt * stmt = sqlite3_prepare_cached(
+      "SELECT SourceFiles.source_path_id, SourcePaths.pathname, \
+              SourceFiles.mtime, SourceFiles.size, SourceFiles.content_hash, \
+              SourceFiles.tier \
+         FROM SourceFiles, SourcePaths \
+        WHERE SourceFiles.source_path_id = SourcePaths.id");
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      long        source_path_id = sqlite3_column_int(stmt, 0);
+      std::string pathname(
+        reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1)));
+      long long   mtime          = sqlite3_column_int64(stmt, 2);
+      long long   size           = sqlite3_column_int64(stmt, 3);
+      uint64_t    content_hash   =
+        static_cast<uint64_t>(sqlite3_column_int64(stmt, 4));
+      int         tier           = sqlite3_column_int(stmt, 5);
+
+      struct stat info;
+      uint64_t    current_hash;
+      bool        candidate = ! candidates || candidates->count(pathname);
+      if (candidate && stat(pathname.c_str(), &info) != 0) {
+        changed.insert(source_path_id);
+        removed.insert(source_path_id);
+      }
+      else if (candidate &&
+               (info.st_mtime != mtime || info.st_size != size) &&
+               (! hash_file(pathname, current_hash) ||
+                current_hash != content_hash))
+        changed.insert(source_path_id);
+      else if (upgrade && tier != TierFull)
+        upgraded.insert(source_path_id);
+      else
+        unchanged.add_previous(pathname, content_hash);
+    }
+    sqlite3_reset(stmt);
+
+    std::set<long> units;
+    for (std::set<long>::const_iterator i = upgraded.begin();
+         i != upgraded.end();
+         ++i) {
+      add_units_including(*i, units);
+      execute_for_id(
+        "DELETE FROM DeclRefs WHERE source_line_id IN \
+           (SELECT id FROM SourceLines WHERE source_path_id = ?);", *i);
+    }
+    for (std::set<long>::const_iterator i = changed.begin();
+         i != changed.end();
+         ++i) {
+      add_units_including(*i, units);
+
+      execute_for_id(
+        "DELETE FROM DeclRefs WHERE source_line_id IN \
+           (SELECT id FROM SourceLines WHERE source_path_id = ?);", *i);
+      execute_for_id(
+        "DELETE FROM SourceLines WHERE source_path_id = ?;", *i);
+
+      // A changed file keeps its old stamp until it has been re-indexed,
+      // so an interrupted update is picked up again by the next one.
+      if (removed.count(*i))
+        execute_for_id(
+          "DELETE FROM SourceFiles WHERE source_path_id = ?;", *i);
+    }
+    // The changed files' lines are gone, so the line cache is rebuilt from
+    // what remains if it was complete.
+    if (! changed.empty()) {
+      source_lines_map.clear();
+      if (CachesComplete)
+        preload_source_lines();
+    }
+
+    std::vector<std::string> sources;
+    for (std::set<long>::const_iterator i = units.begin();
+         i != units.end();
+         ++i) {
+      stmt = sqlite3_prepare_cached(
+        "SELECT pathname FROM SourcePaths WHERE id = ?");
+      sql_chk(sqlite3_bind_int(stmt, 1, static_cast<int>(*i)));
+      std::string pathname;
+      if (sqlite3_step(stmt) == SQLITE_ROW)
+        pathname = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+      sqlite3_reset(stmt);
+      sqlite3_clear_bindings(stmt);
+
+      if (access(pathname.c_str(), R_OK) == 0) {
+        sources.push_back(pathname);
+      } else {
+        execute_for_id(
+          "DELETE FROM TranslationUnitIncludes \
+            WHERE translation_unit_id = ?;", *i);
+        execute_for_id(
+          "DELETE FROM TranslationUnits WHERE source_path_id = ?;", *i);
+      }
+    }
+
+    std::cerr << changed.size() << " files changed, "
+              << upgraded.size() << " to index in full, "
+              << sources.size() << " translation units to re-index"
+              << std::endl;
+    return sources;
+  }
+
+  // The directories of every file indexed so far.
+  std::vector<std::string> source_directories()
+  {
+    std::vector<std::string> directories;
+    sqlite3_stmt * stmt = sqlite3_prepare_cached(
+      "SELECT DISTINCT dir.pathname \
+         FROM SourceFiles, SourcePaths AS file, SourcePaths AS dir \
+        WHERE file.id = SourceFiles.source_path_id \
+          AND dir.id = file.dirname_id");
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+      directories.push_back(sqlite3_column_string(stmt, 0));
+    sqlite3_reset(stmt);
+    return directories;
+  }
+
+  // Whether PATHNAME is a file indexed so far.
+  bool is_source_file(const std::string& pathname)
+  {
+    sqlite3_stmt * stmt = sqlite3_prepare_cached(
+      "SELECT 1 FROM SourceFiles, SourcePaths \
+        WHERE SourcePaths.pathname = ? \
+          AND SourceFiles.source_path_id = SourcePaths.id");
+    sql_chk(sqlite3_bind_text(stmt, 1, pathname.c_str(), pathname.size(),
+                              SQLITE_STATIC));
+    bool found = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return found;
+  }
+
+  // Add to UNITS the translation units whose source is, or includes, the
+  // file SOURCE_PATH_ID.
+  void add_units_including(long source_path_id, std::set<long>& units)
+  {
+    sqlite3_stmt * stmt = sqlite3_prepare_cached(
+      "SELECT source_path_id FROM TranslationUnits \
+        WHERE source_path_id = ? \
+       UNION \
+       SELECT translation_unit_id FROM TranslationUnitIncludes \
+        WHERE source_path_id = ?");
+    sql_chk(sqlite3_bind_int(stmt, 1, static_cast<int>(source_path_id)));
+    sql_chk(sqlite3_bind_int(stmt, 2, static_cast<int>(source_path_id)));
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+      units.insert(sqlite3_column_int(stmt, 0));
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+  }
+
+  // Tell FILES about every source file a previous run indexed at least as
+  // completely as TIER.
+  void load_source_files(IndexedFileSet& files, IndexTier tier)
+  {
+    sqlite3_stmt * stmt = sqlite3_prepare_cached(
+      "SELECT SourcePaths.pathname, SourceFiles.content_hash \
+         FROM SourceFiles, SourcePaths \
+        WHERE SourceFiles.source_path_id = SourcePaths.id \
+          AND SourceFiles.tier <= ?");
+    sql_chk(sqlite3_bind_int(stmt, 1, tier));
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+      files.add_previous(
+        reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)),
+        static_cast<uint64_t>(sqlite3_column_int64(stmt, 1)));
+    sqlite3_reset(stmt);
+  }
+
+  virtual long add_declaration(const TagsDeclRecord& record)
+  {
+    // Timings are only taken when they will be reported.
+    double start = Statistics ? current_time() : 0;
+    begin_batch();
+
+    long source_path_id =
+      source_path(record.file, record.dirname, record.pathname);
+    long source_line_id =
+      source_line(source_path_id, record.line_no, record.line_text);
+    long symbol_name_id = symbol_name(record.short_name, record.full_name);
+    long tdeclaration_id =
+      declaration(symbol_name_id, record.kind_id, record.is_definition,
+                  record.is_implicit);
+    long decl_ref_id =
+      store_decl_ref(tdeclaration_id, record.ref_kind_id, source_line_id,
+                     record.col_no, record.is_implicit, record.context_ref);
+
+    if (Statistics)
+      SqliteSeconds += current_time() - start;
+
+    if (record.ref_kind_id == 3)
+      ++ReferencesCounted;
+    else if (++DeclarationsCounted % 100 == 0)
+      std::cerr << DeclarationsCounted << " declarations counted\r";
+    return decl_ref_id;
+  }
+
+  // The IDs of a file's line, a symbol's names and a declaration, each
+  // inserted if it is not already in the database.
+
+  long source_line(long source_path_id, int lineno, llvm::StringRef text)
+  {
+    SourceLine source_line(source_path_id, lineno);
+    int * source_line_i = source_lines_map.find(source_line);
+    SourceLinesCounter.count(source_line_i);
+    if (source_line_i)
+      return *source_line_i;
+
+    long source_line_id =
+      sqlite3_insert_maybe(
+        "SELECT id FROM SourceLines \
+           WHERE source_path_id = ? AND lineno = ?",
+        "INSERT INTO SourceLines (source_path_id, lineno, text) \
+           VALUES (?, ?, ?);",
+        "iit", source_line.source_path_id, source_line.lineno,
+        text.data(), static_cast<int>(text.size()));
+
+    source_lines_map.insert(source_line, source_line_id);
+    return source_line_id;
+  }
+
+  // The symbol FULL_NAME, whose last part is SHORT_NAME.  Its scopes are
+  // added first, each as a member of the one before.
+  long symbol_name(const std::string& short_name,
+                   const std::string& full_name)
+  {
+    llvm::StringRef name(full_name);
+    std::size_t scope_length = 0;
+    if (name.size() > short_name.size() + 2 && name.endswith(short_name) &&
+        name.substr(name.size() - short_name.size() - 2).startswith("::"))
+      scope_length = name.size() - short_name.size() - 2;
+    else {
+      // Not built from SHORT_NAME as getQualifiedNameAsString does, so
+      // split it as it is.
+      std::size_t last = last_scope_separator(name);
+      if (last != llvm::StringRef::npos)
+        scope_length = last;
+    }
+
+    // Queries split a full name with find_scope_separator alone, so they
+    // must find the same scope as is stored here.
+    assert(last_scope_separator(name) ==
+           (scope_length ? scope_length : llvm::StringRef::npos));
+
+    if (! scope_length)
+      return scope_member(0, name);
+
+    llvm::StringRef scope(name.substr(0, scope_length));
+    if (scope != LastScope) {
+      long parent_id = 0;
+      std::size_t start = 0;
+      for (;;) {
+        std::size_t end = find_scope_separator(scope, start);
+        parent_id = scope_member(parent_id, scope.slice(start, end));
+        if (end == llvm::StringRef::npos)
+          break;
+        start = end + 2;
+      }
+      LastScope   = scope;
+      LastScopeId = parent_id;
+    }
+    return scope_member(LastScopeId, name.substr(scope_length + 2));
+  }
+
+  // The member NAME of the scope PARENT_ID, or of the global scope if it
+  // is zero.
+  long scope_member(long parent_id, llvm::StringRef name)
+  {
+    SymbolName symbol_name(parent_id, name_id(name));
+    int * symbol_name_i = symbol_names_map.find(symbol_name);
+    SymbolNamesCounter.count(symbol_name_i);
+    if (symbol_name_i)
+      return *symbol_name_i;
+
+    long symbol_name_id =
+      sqlite3_insert_maybe(
+        "SELECT id FROM SymbolNames WHERE parent_id = ? AND name_id = ?",
+        "INSERT INTO SymbolNames (parent_id, name_id) VALUES (?, ?);",
+        "ii", symbol_name.parent_id, symbol_name.name_id);
+
+    symbol_names_map.insert(symbol_name, symbol_name_id);
+    return symbol_name_id;
+  }
+
+  long name_id(llvm::StringRef name)
+  {
+    uint32_t string_id = cache_strings.intern(name.data(), name.size());
+    if (string_id < name_ids.size() && name_ids[string_id])
+      return name_ids[string_id];
+
+    long id =
+      sqlite3_insert_maybe(
+        "SELECT id FROM Names WHERE name = ?",
+        "INSERT INTO Names (name) VALUES (?);",
+        "t", name.data(), static_cast<int>(name.size()));
+
+    set_name_id(string_id, id);
+    return id;
+  }
+
+  void set_name_id(uint32_t string_id, long id)
+  {
+    if (string_id >= name_ids.size())
+      name_ids.resize(cache_strings.size(), 0);
+    name_ids[string_id] = static_cast<int>(id);
+  }
+
+  long declaration(long symbol_name_id, int kind_id, int is_definition,
+                   int is_implicit)
+  {
+    TDeclaration tdeclaration(
+      symbol_name_id, kind_id, is_definition, is_implicit);
+    int * tdeclaration_i = tdeclarations_map.find(tdeclaration);
+    DeclarationsCounter.count(tdeclaration_i);
+    if (tdeclaration_i)
+      return *tdeclaration_i;
+
+    long tdeclaration_id =
+      sqlite3_insert_maybe(
+        "SELECT id FROM Declarations \
+           WHERE symbol_name_id = ? AND kind_id = ? AND \
+                 is_definition = ? AND is_implicitly_defined = ?",
+        "INSERT INTO Declarations (symbol_name_id, kind_id, is_definition, \
+                                   is_implicitly_defined) \
+           VALUES (?, ?, ?, ?);",
+        "iiii", tdeclaration.symbol_name_id, tdeclaration.kind_id,
+        tdeclaration.is_definition, tdeclaration.is_implicitly_defined);
+
+    tdeclarations_map.insert(tdeclaration, tdeclaration_id);
+    return tdeclaration_id;
+  }
+
+  long store_decl_ref(long declaration_id, int ref_kind_id,
+                      long source_line_id, int col_no, int is_implicit,
+                      long context_ref)
+  {
+    long decl_ref_id = 1;
+    sqlite3_stmt * stmt = sqlite3_prepare_cached(
+      "INSERT OR IGNORE INTO DeclRefs ( \
+           declaration_id, ref_kind_id, source_line_id, colno, is_implicit, \
+           context_ref_id) \
+           VALUES (?, ?, ?, ?, ?, ?);");
+    sql_chk(sqlite3_bind_int(stmt, 1, static_cast<int>(declaration_id)));
+    sql_chk(sqlite3_bind_int(stmt, 2, ref_kind_id));
+    sql_chk(sqlite3_bind_int(stmt, 3, static_cast<int>(source_line_id)));
+    sql_chk(sqlite3_bind_int(stmt, 4, col_no));
+    sql_chk(sqlite3_bind_int(stmt, 5, is_implicit));
+    if (context_ref)
+      sql_chk(sqlite3_bind_int(stmt, 6, static_cast<int>(context_ref)));
+    else
+      sql_chk(sqlite3_bind_null(stmt, 6));
+    sqlite3_step_for_id(stmt);
+    decl_ref_id = static_cast<long>(sqlite3_last_insert_rowid(database));
+    row_written(6 * sizeof(int));
+    return decl_ref_id;
+  }
+
+  // Prepare for a long run of queries: map the database into memory and
+  // prepare the query statements ahead of the first request.
+  void warm_up()
+  {
+    sqlite3_void_exec("PRAGMA mmap_size = 1073741824;");
+    find_declaration("");
+  }
+
+  virtual std::vector<TagsDeclInfo> find_declaration(const std::string& name)
+  {
+    return declarations_of(find_symbol_name(name), name);
+  }
+
+  // The declarations and definitions of the symbol SYMBOL_ID, named NAME.
+  std::vector<TagsDeclInfo> declarations_of(long symbol_id,
+                                            const std::string& name)
+  {
+    sqlite3_stmt * stmt = sqlite3_prepare_cached("\
+SELECT                                                  \
+    Declarations.id,                                    \
+    SourcePaths.pathname,                               \
+    SourceLines.lineno,                                 \
+    DeclRefs.colno,                                     \
+    SourceLines.text                                    \
+FROM                                                    \
+    DeclRefs,                                           \
+    Declarations,                                       \
+    SourcePaths,                                        \
+    SourceLines                                         \
+WHERE                                                   \
+    DeclRefs.declaration_id     = Declarations.id       \
+AND DeclRefs.source_line_id     = SourceLines.id        \
+AND SourceLines.source_path_id  = SourcePaths.id        \
+AND DeclRefs.ref_kind_id        IN (1, 2)               \
+AND Declarations.symbol_name_id = ?;");
+    return query_tags(stmt, name, symbol_id);
+  }
+
+  // Every use of the symbol named NAME.  The DeclRefs rows are reached
+  // through DeclRefs_declaration_id_idx from the symbol's few Declarations
+  // rows, so the cost depends only on the number of uses returned.
+  virtual std::vector<TagsDeclInfo> find_references(const std::string& name)
+  {
+    sqlite3_stmt * stmt = sqlite3_prepare_cached("\
+SELECT                                                  \
+    DeclRefs.declaration_id,                            \
+    SourcePaths.pathname,                               \
+    SourceLines.lineno,                                 \
+    DeclRefs.colno,                                     \
+    SourceLines.text                                    \
+FROM                                                    \
+    DeclRefs,                                           \
+    SourcePaths,                                        \
+    SourceLines                                         \
+WHERE                                                   \
+    DeclRefs.declaration_id IN                          \
+    (                                                   \
+        SELECT                                          \
+            id                                          \
+        FROM                                            \
+            Declarations                                \
+        WHERE                                           \
+            symbol_name_id = ?                          \
+    )                                                   \
+AND DeclRefs.ref_kind_id        = 3                     \
+AND DeclRefs.source_line_id     = SourceLines.id        \
+AND SourceLines.source_path_id  = SourcePaths.id        \
+ORDER BY                                                \
+    SourcePaths.pathname, SourceLines.lineno, DeclRefs.colno;");
+    return query_tags(stmt, name, find_symbol_name(name));
+  }
+
+  // The symbols whose short names start with PREFIX, ignoring case, best
+  // first.  The candidates are read in order from Names_name_nocase_idx
+  // starting at PREFIX, stopping at the first name that does not match,
+  // and each name's symbols through SymbolNames_name_id_idx.  Scopes that
+  // were never declared themselves, such as a function's parameter list,
+  // are left out.
+  virtual std::vector<TagsCompletion> complete(const std::string& prefix,
+                                               unsigned limit)
+  {
+    std::vector<TagsCompletionCandidate> candidates;
+
+    sqlite3_stmt * stmt = sqlite3_prepare_cached(
+      "SELECT SymbolNames.id, Names.name FROM Names, SymbolNames \
+        WHERE Names.name COLLATE NOCASE >= ? \
+          AND SymbolNames.name_id = Names.id \
+          AND EXISTS (SELECT 1 FROM Declarations \
+                       WHERE symbol_name_id = SymbolNames.id) \
+        ORDER BY Names.name COLLATE NOCASE");
+    sql_chk(sqlite3_bind_text(stmt, 1, prefix.c_str(), prefix.size(),
+                              SQLITE_STATIC));
+    while (candidates.size() < CompletionCandidates &&
+           sqlite3_step(stmt) == SQLITE_ROW) {
+      const char * short_name =
+        reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
+      std::size_t length = sqlite3_column_bytes(stmt, 1);
+      if (length < prefix.size() ||
+          sqlite3_strnicmp(short_name, prefix.c_str(), prefix.size()) != 0)
+        break;
+
+      TagsCompletionCandidate candidate;
+      candidate.id              = sqlite3_column_int(stmt, 0);
+      candidate.exact           = length == prefix.size();
+      candidate.case_match      =
+        std::memcmp(short_name, prefix.data(), prefix.size()) == 0;
+      candidate.completion.short_name.assign(short_name, length);
+      candidates.push_back(candidate);
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+    rank_completions(candidates, limit);
+
+    std::map<long, std::string> scopes;
+    std::vector<TagsCompletion> completions;
+    for (std::vector<TagsCompletionCandidate>::iterator i =
+           candidates.begin();
+         i != candidates.end();
+         ++i) {
+      (*i).completion.full_name = full_symbol_name((*i).id, scopes);
+
+      stmt = sqlite3_prepare_cached(
+        "SELECT DISTINCT DeclKinds.description \
+           FROM Declarations, DeclKinds \
+          WHERE Declarations.symbol_name_id = ? \
+            AND DeclKinds.id = Declarations.kind_id");
+      sql_chk(sqlite3_bind_int(stmt, 1, static_cast<int>((*i).id)));
+      while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (! (*i).completion.kinds.empty())
+          (*i).completion.kinds += ",";
+        (*i).completion.kinds += sqlite3_column_string(stmt, 0);
+      }
+      sqlite3_reset(stmt);
+      sqlite3_clear_bindings(stmt);
+
+      completions.push_back((*i).completion);
+    }
+    return completions;
+  }
+
+  // The declarations and definitions of the symbol at PATHNAME:LINE_NO:
+  // COL_NO.  The line's references are read from the covering index
+  // DeclRefs_line_col_decl_idx, rightmost first; the symbol chosen is the
+  // one whose name spans the column, or failing that the nearest starting
+  // before it, since declarations are located at their start rather than
+  // at their name.
+  virtual std::vector<TagsDeclInfo>
+  find_at(const std::string& pathname, int line_no, int col_no)
+  {
+    sqlite3_stmt * stmt = sqlite3_prepare_cached("\
+SELECT                                                  \
+    DeclRefs.colno,                                     \
+    length(Names.name),                                 \
+    SymbolNames.id                                      \
+FROM                                                    \
+    SourcePaths,                                        \
+    SourceLines,                                        \
+    DeclRefs,                                           \
+    Declarations,                                       \
+    SymbolNames,                                        \
+    Names                                               \
+WHERE                                                   \
+    SourcePaths.pathname        = ?                     \
+AND SourceLines.source_path_id  = SourcePaths.id        \
+AND SourceLines.lineno          = ?                     \
+AND DeclRefs.source_line_id     = SourceLines.id        \
+AND DeclRefs.colno              <= ?                    \
+AND Declarations.id             =                       \
+    DeclRefs.declaration_id                             \
+AND SymbolNames.id              =                       \
+    Declarations.symbol_name_id                         \
+AND Names.id                    = SymbolNames.name_id   \
+ORDER BY                                                \
+    DeclRefs.colno DESC;");
+    sql_chk(sqlite3_bind_text(stmt, 1, pathname.c_str(), pathname.size(),
+                              SQLITE_STATIC));
+    sql_chk(sqlite3_bind_int(stmt, 2, line_no));
+    sql_chk(sqlite3_bind_int(stmt, 3, col_no));
+
+    std::set<long> spanning;
+    std::set<long> nearest;
+    int nearest_col_no = -1;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      int ref_col_no = sqlite3_column_int(stmt, 0);
+      if (col_no < ref_col_no + sqlite3_column_int(stmt, 1))
+        spanning.insert(sqlite3_column_int(stmt, 2));
+      else if (nearest_col_no == -1 || nearest_col_no == ref_col_no) {
+        nearest_col_no = ref_col_no;
+        nearest.insert(sqlite3_column_int(stmt, 2));
+      }
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+    // The symbols' declarations are listed in order of their names.
+    const std::set<long>& ids(spanning.empty() ? nearest : spanning);
+    std::map<long, std::string> scopes;
+    std::map<std::string, long> names;
+    for (std::set<long>::const_iterator i = ids.begin(); i != ids.end(); ++i)
+      names[full_symbol_name(*i, scopes)] = *i;
+
+    std::vector<TagsDeclInfo> tags;
+    for (std::map<std::string, long>::const_iterator i = names.begin();
+         i != names.end();
+         ++i) {
+      std::vector<TagsDeclInfo> found(declarations_of((*i).second,
+                                                      (*i).first));
+      tags.insert(tags.end(), found.begin(), found.end());
+    }
+    return tags;
+  }
+
+  // The declarations of each member of the scope SCOPE, or of the global
+  // scope if it is empty, in order of the members' names.  The members
+  // are read through SymbolNames_parent_name_idx.
+  virtual std::vector<TagsDeclInfo> find_members(const std::string& scope)
+  {
+    std::vector<TagsDeclInfo> tags;
+    long scope_id = scope.empty() ? 0 : find_symbol_name(scope);
+    if (! scope.empty() && ! scope_id)
+      return tags;
+
+    std::vector<std::pair<std::string, long> > members;
+    sqlite3_stmt * stmt = sqlite3_prepare_cached(
+      "SELECT Names.name, SymbolNames.id FROM SymbolNames, Names \
+        WHERE SymbolNames.parent_id = ? AND Names.id = SymbolNames.name_id \
+        ORDER BY Names.name");
+    sql_chk(sqlite3_bind_int(stmt, 1, static_cast<int>(scope_id)));
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+      members.push_back(
+        std::make_pair(scope.empty() ? sqlite3_column_string(stmt, 0) :
+                       scope + "::" + sqlite3_column_string(stmt, 0),
+                       static_cast<long>(sqlite3_column_int(stmt, 1))));
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+    for (std::vector<std::pair<std::string, long> >::const_iterator i =
+           members.begin();
+         i != members.end();
+         ++i) {
+      std::vector<TagsDeclInfo> found(declarations_of((*i).second,
+                                                      (*i).first));
+      tags.insert(tags.end(), found.begin(), found.end());
+    }
+    return tags;
+  }
+
+  // The ID of the symbol whose full name is NAME, or zero if there is
+  // none, found by looking each of its scopes up in turn.
+  long find_symbol_name(const std::string& name)
+  {
+    sqlite3_stmt * stmt = sqlite3_prepare_cached(
+      "SELECT SymbolNames.id FROM Names, SymbolNames \
+        WHERE Names.name = ? AND SymbolNames.parent_id = ? \
+          AND SymbolNames.name_id = Names.id");
+
+    long id = 0;
+    std::size_t start = 0;
+    for (;;) {
+      std::size_t end = find_scope_separator(name, start);
+      llvm::StringRef part(llvm::StringRef(name).slice(start, end));
+      sql_chk(sqlite3_bind_text(stmt, 1, part.data(), part.size(),
+                                SQLITE_STATIC));
+      sql_chk(sqlite3_bind_int(stmt, 2, static_cast<int>(id)));
+      id = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : 0;
+      sqlite3_reset(stmt);
+      sqlite3_clear_bindings(stmt);
+
+      if (! id || end == llvm::StringRef::npos)
+        return id;
+      start = end + 2;
+    }
+  }
+
+  // The full name of the symbol ID, rebuilt from its scopes.  SCOPES holds
+  // the full names already rebuilt, and gains this one.
+  std::string full_symbol_name(long id, std::map<long, std::string>& scopes)
+  {
+    std::map<long, std::string>::const_iterator i = scopes.find(id);
+    if (i != scopes.end())
+      return (*i).second;
+
+    sqlite3_stmt * stmt = sqlite3_prepare_cached(
+      "SELECT SymbolNames.parent_id, Names.name FROM SymbolNames, Names \
+        WHERE SymbolNames.id = ? AND Names.id = SymbolNames.name_id");
+    sql_chk(sqlite3_bind_int(stmt, 1, static_cast<int>(id)));
+    long parent_id = 0;
+    std::string name;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      parent_id = sqlite3_column_int(stmt, 0);
+      name      = sqlite3_column_string(stmt, 1);
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+    if (parent_id)
+      name = full_symbol_name(parent_id, scopes) + "::" + name;
+    scopes[id] = name;
+    return name;
+  }
+
+  // Add the databases SHARDS, written by indexing runs with --shard, to
+  // this one in order.  Each shard's rows are read once and their IDs
+  // remapped through the caches, so rows that several shards share, such
+  // as the declarations in a common header, are stored once, and the time
+  // taken is linear in the total number of rows.
+  void merge_shards(const std::vector<std::string>& shards)
+  {
+    preload_caches();
+
+    OpenHashMap<DeclRefKey> decl_refs_map;
+    sqlite3_stmt * stmt = sqlite3_prepare_cached(
+      "SELECT id, declaration_id, ref_kind_id, source_line_id, colno \
+         FROM DeclRefs");
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+      decl_refs_map.insert(
+        DeclRefKey(sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2),
+                   sqlite3_column_int(stmt, 3), sqlite3_column_int(stmt, 4)),
+        sqlite3_column_int(stmt, 0));
+    sqlite3_reset(stmt);
+
+    for (std::vector<std::string>::const_iterator i = shards.begin();
+         i != shards.end();
+         ++i)
+      merge_shard(*i, decl_refs_map);
+  }
+
+  // Write everything in the database to PATH as a read-only index for
+  // MappedTagsDatabase.  The file is written beside PATH and renamed over
+  // it, so a server still mapping the old one is unaffected.
+  void export_index(const std::string& path)
+  {
+    commit_batch();
+
+    std::string temp_path(path + ".tmp");
+    std::FILE * file = std::fopen(temp_path.c_str(), "wb");
+    if (! file)
+      llvm::report_fatal_error("Cannot create " + temp_path);
+
+    MappedIndexHeader header;
+    std::memset(&header, 0, sizeof header);
+    MappedIndexWriter writer(file);
+    writer.write(&header, sizeof header);
+    header.strings_offset = writer.position();
+    writer.begin_strings();
+
+    // IDs are dense, so each table's rows are found by ID in a vector.
+    const uint32_t none = 0xffffffffU;
+
+    std::vector<MappedFile> files;
+    std::vector<uint32_t>   file_of_path;
+    sqlite3_stmt * stmt = sqlite3_prepare_cached(
+      "SELECT id, pathname FROM SourcePaths ORDER BY pathname");
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      MappedFile mapped_file;
+      mapped_file.pathname = writer.add_string(
+        reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1)),
+        sqlite3_column_bytes(stmt, 1));
+      mapped_file.first_position = 0;
+      set_at(file_of_path, sqlite3_column_int(stmt, 0),
+             static_cast<uint32_t>(files.size()), none);
+      files.push_back(mapped_file);
+    }
+    sqlite3_reset(stmt);
+
+    // Full names are rebuilt in ID order, in which each scope precedes its
+    // members, and then sorted.  Scopes never declared themselves are not
+    // exported.
+    std::vector<std::string> full_names;
+    std::vector<std::size_t> short_lengths;
+    std::vector<uint32_t>    declared;
+    stmt = sqlite3_prepare_cached(
+      "SELECT SymbolNames.id, SymbolNames.parent_id, Names.name, \
+              EXISTS (SELECT 1 FROM Declarations \
+                       WHERE symbol_name_id = SymbolNames.id) \
+         FROM SymbolNames, Names \
+        WHERE Names.id = SymbolNames.name_id \
+        ORDER BY SymbolNames.id");
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      std::size_t id        = sqlite3_column_int(stmt, 0);
+      std::size_t parent_id = sqlite3_column_int(stmt, 1);
+      if (id >= full_names.size()) {
+        full_names.resize(id + 1);
+        short_lengths.resize(id + 1);
+      }
+      std::string& full_name(full_names[id]);
+      if (parent_id && parent_id < id)
+        full_name = full_names[parent_id] + "::";
+      full_name.append(
+        reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2)),
+        sqlite3_column_bytes(stmt, 2));
+      short_lengths[id] = sqlite3_column_bytes(stmt, 2);
+      if (sqlite3_column_int(stmt, 3))
+        declared.push_back(static_cast<uint32_t>(id));
+    }
+    sqlite3_reset(stmt);
+    std::sort(declared.begin(), declared.end(), FullNameOrder(full_names));
+
+    std::vector<MappedSymbol> symbols;
+    std::vector<std::string>  short_names;
+    std::vector<uint32_t>     symbol_of_name;
+    for (std::vector<uint32_t>::const_iterator i = declared.begin();
+         i != declared.end();
+         ++i) {
+      const std::string& full_name(full_names[*i]);
+
+      MappedSymbol symbol;
+      std::memset(&symbol, 0, sizeof symbol);
+      std::memcpy(symbol.prefix, full_name.data(),
+                  std::min(full_name.size(), sizeof symbol.prefix));
+      symbol.full_name = writer.add_string(full_name.data(),
+                                           full_name.size());
+      short_names.push_back(
+        full_name.substr(full_name.size() - short_lengths[*i]));
+      symbol.short_name = writer.add_string(short_names.back().data(),
+                                            short_names.back().size());
+      set_at(symbol_of_name, *i, static_cast<uint32_t>(symbols.size()),
+             none);
+      symbols.push_back(symbol);
+    }
+    std::vector<std::string>().swap(full_names);
+
+    std::vector<uint32_t> text_of_line;
+    stmt = sqlite3_prepare_cached("SELECT id, text FROM SourceLines");
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+      set_at(text_of_line, sqlite3_column_int(stmt, 0),
+             writer.add_string(
+               reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1)),
+               sqlite3_column_bytes(stmt, 1)), none);
+    sqlite3_reset(stmt);
+    header.strings_size = writer.position() - header.strings_offset;
+
+    std::vector<ExportedRef> exported;
+    stmt = sqlite3_prepare_cached(
+      "SELECT Declarations.symbol_name_id, Declarations.kind_id, \
+              DeclRefs.ref_kind_id, SourceLines.source_path_id, \
+              SourceLines.lineno, DeclRefs.colno, DeclRefs.source_line_id \
+         FROM DeclRefs, Declarations, SourceLines \
+        WHERE Declarations.id = DeclRefs.declaration_id \
+          AND SourceLines.id  = DeclRefs.source_line_id");
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      ExportedRef ref;
+      ref.ref.symbol  = get_at(symbol_of_name, sqlite3_column_int(stmt, 0),
+                               none);
+      ref.ref.file    = get_at(file_of_path, sqlite3_column_int(stmt, 3),
+                               none);
+      ref.ref.line_no = sqlite3_column_int(stmt, 4);
+      ref.ref.col_no  = sqlite3_column_int(stmt, 5);
+      ref.ref.text    = get_at(text_of_line, sqlite3_column_int(stmt, 6),
+                               none);
+      ref.is_use      = sqlite3_column_int(stmt, 2) == 3;
+      if (ref.ref.symbol == none || ref.ref.file == none ||
+          ref.ref.text == none)
+        continue;
+
+      uint32_t kind_id = sqlite3_column_int(stmt, 1);
+      if (kind_id < 32)
+        symbols[ref.ref.symbol].kinds |= 1U << kind_id;
+      exported.push_back(ref);
+    }
+    sqlite3_reset(stmt);
+
+    // Order each symbol's references and drop any recorded twice.
+    std::sort(exported.begin(), exported.end());
+    exported.erase(std::unique(exported.begin(), exported.end()),
+                   exported.end());
+
+    std::vector<MappedRef> refs;
+    refs.reserve(exported.size());
+    for (std::vector<ExportedRef>::const_iterator i = exported.begin();
+         i != exported.end();
+         ++i) {
+      MappedSymbol& symbol(symbols[(*i).ref.symbol]);
+      if (symbol.declaration_count + symbol.use_count == 0)
+        symbol.first_ref = static_cast<uint32_t>(refs.size());
+      ++((*i).is_use ? symbol.use_count : symbol.declaration_count);
+      refs.push_back((*i).ref);
+    }
+    std::vector<ExportedRef>().swap(exported);
+
+    std::vector<uint32_t> by_position(refs.size());
+    for (uint32_t i = 0; i < by_position.size(); ++i)
+      by_position[i] = i;
+    std::sort(by_position.begin(), by_position.end(), PositionOrder(refs));
+
+    MappedFile end_of_files = { 0, 0 };
+    files.push_back(end_of_files);
+    for (std::vector<MappedRef>::const_iterator i = refs.begin();
+         i != refs.end();
+         ++i)
+      ++files[(*i).file + 1].first_position;
+    for (std::size_t i = 1; i < files.size(); ++i)
+      files[i].first_position += files[i - 1].first_position;
+
+    std::vector<uint32_t> by_short_name(symbols.size());
+    for (uint32_t i = 0; i < by_short_name.size(); ++i)
+      by_short_name[i] = i;
+    std::sort(by_short_name.begin(), by_short_name.end(),
+              ShortNameOrder(short_names));
+
+    header.files_offset         = writer.write_array(files);
+    header.symbols_offset       = writer.write_array(symbols);
+    header.by_short_name_offset = writer.write_array(by_short_name);
+    header.refs_offset          = writer.write_array(refs);
+    header.by_position_offset   = writer.write_array(by_position);
+
+    std::memcpy(header.magic, mapped_index_magic, sizeof header.magic);
+    header.version      = mapped_index_version;
+    header.symbol_count = static_cast<uint32_t>(symbols.size());
+    header.ref_count    = static_cast<uint32_t>(refs.size());
+    header.file_count   = static_cast<uint32_t>(files.size() - 1);
+
+    if (std::fseek(file, 0, SEEK_SET) != 0 ||
+        std::fwrite(&header, sizeof header, 1, file) != 1 ||
+        std::fclose(file) != 0 ||
+        std::rename(temp_path.c_str(), path.c_str()) != 0)
+      llvm::report_fatal_error("Cannot write " + path);
+
+    std::cerr << "Exported " << header.symbol_count << " symbols, "
+              << header.ref_count << " references and "
+              << header.file_count << " files to " << path << std::endl;
+  }
+
+private:
+  // Merge the shard at PATH, attached as the schema "shard".  The vectors
+  // map each of the shard's IDs to the ID of the same row here; a row
+  // always follows the rows it refers to, so one pass over each table in
+  // ID order suffices.
+  void merge_shard(const std::string& path,
+                   OpenHashMap<DeclRefKey>& decl_refs_map)
+  {
+    if (access(path.c_str(), R_OK) != 0)
+      llvm::report_fatal_error("Cannot read shard " + path);
+
+    commit_batch();
+    sqlite3_stmt * stmt = sqlite3_prepare_cached(
+      "ATTACH DATABASE ? AS shard;");
+    sql_chk(sqlite3_bind_text(stmt, 1, path.c_str(), -1, SQLITE_TRANSIENT));
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+      llvm::report_fatal_error("Cannot attach shard " + path);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+    if (shard_count("SELECT version FROM shard.SchemaInfo") !=
+        tags_schema_version)
+      llvm::report_fatal_error(
+        path + " has another schema version; run 'clang-tags update "
+        "--output " + path + "' to upgrade it");
+
+    begin_batch();
+
+    std::vector<int> paths(
+      shard_count("SELECT IFNULL(MAX(id), 0) + 1 FROM shard.SourcePaths"));
+    stmt = sqlite3_prepare_cached(
+      "SELECT file.id, dir.pathname, file.pathname \
+         FROM shard.SourcePaths AS file \
+         LEFT JOIN shard.SourcePaths AS dir ON file.dirname_id = dir.id \
+        ORDER BY file.id");
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      std::string pathname(sqlite3_column_string(stmt, 2));
+      paths[sqlite3_column_int(stmt, 0)] =
+        sqlite3_column_type(stmt, 1) == SQLITE_NULL
+        ? source_directory(pathname)
+        : source_path(sqlite3_column_string(stmt, 1), pathname);
+    }
+    sqlite3_reset(stmt);
+
+    std::vector<int> lines(
+      shard_count("SELECT IFNULL(MAX(id), 0) + 1 FROM shard.SourceLines"));
+    stmt = sqlite3_prepare_cached(
+      "SELECT id, source_path_id, lineno, text FROM shard.SourceLines \
+        ORDER BY id");
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      const char * text =
+        reinterpret_cast<const char *>(sqlite3_column_text(stmt, 3));
+      lines[sqlite3_column_int(stmt, 0)] =
+        source_line(paths[sqlite3_column_int(stmt, 1)],
+                    sqlite3_column_int(stmt, 2),
+                    llvm::StringRef(text, sqlite3_column_bytes(stmt, 3)));
+    }
+    sqlite3_reset(stmt);
+
+    std::vector<int> names(
+      shard_count("SELECT IFNULL(MAX(id), 0) + 1 FROM shard.SymbolNames"));
+    stmt = sqlite3_prepare_cached(
+      "SELECT SymbolNames.id, SymbolNames.parent_id, Names.name \
+         FROM shard.SymbolNames AS SymbolNames, shard.Names AS Names \
+        WHERE Names.id = SymbolNames.name_id \
+        ORDER BY SymbolNames.id");
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      int parent_id = sqlite3_column_int(stmt, 1);
+      names[sqlite3_column_int(stmt, 0)] =
+        scope_member(parent_id ? names[parent_id] : 0,
+                     llvm::StringRef(
+                       reinterpret_cast<const char *>(
+                         sqlite3_column_text(stmt, 2)),
+                       sqlite3_column_bytes(stmt, 2)));
+    }
+    sqlite3_reset(stmt);
+
+    std::vector<int> declarations(
+      shard_count("SELECT IFNULL(MAX(id), 0) + 1 FROM shard.Declarations"));
+    stmt = sqlite3_prepare_cached(
+      "SELECT id, symbol_name_id, kind_id, is_definition, \
+              is_implicitly_defined \
+         FROM shard.Declarations ORDER BY id");
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+      declarations[sqlite3_column_int(stmt, 0)] =
+        declaration(names[sqlite3_column_int(stmt, 1)],
+                    sqlite3_column_int(stmt, 2), sqlite3_column_int(stmt, 3),
+                    sqlite3_column_int(stmt, 4));
+    sqlite3_reset(stmt);
+
+    // References already here are kept, and their IDs used as the context
+    // of the shard's references within them.
+    std::vector<int> refs(
+      shard_count("SELECT IFNULL(MAX(id), 0) + 1 FROM shard.DeclRefs"));
+    unsigned long read  = 0;
+    unsigned long added = 0;
+    stmt = sqlite3_prepare_cached(
+      "SELECT id, declaration_id, ref_kind_id, source_line_id, colno, \
+              is_implicit, context_ref_id \
+         FROM shard.DeclRefs ORDER BY id");
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      ++read;
+      DeclRefKey key(declarations[sqlite3_column_int(stmt, 1)],
+                     sqlite3_column_int(stmt, 2),
+                     lines[sqlite3_column_int(stmt, 3)],
+                     sqlite3_column_int(stmt, 4));
+      int& ref(refs[sqlite3_column_int(stmt, 0)]);
+      int * existing = decl_refs_map.find(key);
+      if (existing) {
+        ref = *existing;
+        continue;
+      }
+
+      int context_ref = sqlite3_column_int(stmt, 6);
+      ref = store_decl_ref(key.declaration_id, key.ref_kind_id,
+                           key.source_line_id, key.colno,
+                           sqlite3_column_int(stmt, 5),
+                           context_ref ? refs[context_ref] : 0);
+      decl_refs_map.insert(key, ref);
+      ++added;
+    }
+    sqlite3_reset(stmt);
+
+    stmt = sqlite3_prepare_cached(
+      "SELECT source_path_id, mtime, size, content_hash, tier \
+         FROM shard.SourceFiles");
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+      store_source_file(
+        paths[sqlite3_column_int(stmt, 0)], sqlite3_column_int64(stmt, 1),
+        sqlite3_column_int64(stmt, 2),
+        static_cast<uint64_t>(sqlite3_column_int64(stmt, 3)),
+        sqlite3_column_int(stmt, 4));
+    sqlite3_reset(stmt);
+
+    stmt = sqlite3_prepare_cached(
+      "SELECT source_path_id FROM shard.TranslationUnits");
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      execute_for_id(
+        "INSERT OR IGNORE INTO TranslationUnits (source_path_id) \
+           VALUES (?);", paths[sqlite3_column_int(stmt, 0)]);
+      row_written(sizeof(int));
+    }
+    sqlite3_reset(stmt);
+
+    stmt = sqlite3_prepare_cached(
+      "SELECT translation_unit_id, source_path_id \
+         FROM shard.TranslationUnitIncludes");
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      sqlite3_stmt * insert = sqlite3_prepare_cached(
+        "INSERT OR IGNORE INTO TranslationUnitIncludes \
+             (translation_unit_id, source_path_id) VALUES (?, ?);");
+      sql_chk(sqlite3_bind_int(insert, 1,
+                               paths[sqlite3_column_int(stmt, 0)]));
+      sql_chk(sqlite3_bind_int(insert, 2,
+                               paths[sqlite3_column_int(stmt, 1)]));
+      sqlite3_step_for_id(insert);
+      row_written(2 * sizeof(int));
+    }
+    sqlite3_reset(stmt);
+
+    commit_batch();
+    sqlite3_void_exec("DETACH DATABASE shard;");
+
+    std::cerr << "Merged " << path << ": " << added << " of " << read
+              << " references were new" << std::endl;
+  }
+
+  // The integer that SQL, a query of the attached shard, returns.
+  long shard_count(const char * sql)
+  {
+    sqlite3_stmt * stmt = sqlite3_prepare_cached(sql);
+    long count = 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+      count = static_cast<long>(sqlite3_column_int64(stmt, 0));
+    sqlite3_reset(stmt);
+    return count;
+  }
+
+  // A reference being exported, with whether it is a use, ordered as the
+  // references of a MappedSymbol are.
+  struct ExportedRef
+  {
+    MappedRef ref;
+    bool      is_use;
+
+    bool operator<(const ExportedRef& right) const {
+      if (ref.symbol != right.ref.symbol)
+        return ref.symbol < right.ref.symbol;
+      if (is_use != right.is_use)
+        return right.is_use;
+      if (ref.file != right.ref.file)
+        return ref.file < right.ref.file;
+      if (ref.line_no != right.ref.line_no)
+        return ref.line_no < right.ref.line_no;
+      return ref.col_no < right.ref.col_no;
+    }
+    bool operator==(const ExportedRef& right) const {
+      return ! (*this < right) && ! (right < *this);
+    }
+  };
+
+  struct PositionOrder
+  {
+    const std::vector<MappedRef>& refs;
+
+    explicit PositionOrder(const std::vector<MappedRef>& refs) : refs(refs) {}
+
+    bool operator()(uint32_t left, uint32_t right) const {
+      const MappedRef& l(refs[left]);
+      const MappedRef& r(refs[right]);
+      if (l.file != r.file)
+        return l.file < r.file;
+      if (l.line_no != r.line_no)
+        return l.line_no < r.line_no;
+      return l.col_no < r.col_no;
+    }
+  };
+
+  struct FullNameOrder
+  {
+    const std::vector<std::string>& names;
+
+    explicit FullNameOrder(const std::vector<std::string>& names)
+      : names(names) {}
+
+    bool operator()(uint32_t left, uint32_t right) const {
+      return names[left] < names[right];
+    }
+  };
+
+  struct ShortNameOrder
+  {
+    const std::vector<std::string>& names;
+
+    explicit ShortNameOrder(const std::vector<std::string>& names)
+      : names(names) {}
+
+    bool operator()(uint32_t left, uint32_t right) const {
+      const std::string& l(names[left]);
+      const std::string& r(names[right]);
+      int diff = compare_nocase(l.data(), r.data(),
+                                std::min(l.size(), r.size()));
+      if (diff)
+        return diff < 0;
+      if (l.size() != r.size())
+        return l.size() < r.size();
+      return left < right;
+    }
+  };
+
+  static void set_at(std::vector<uint32_t>& items, int index,
+                     uint32_t value, uint32_t none)
+  {
+    if (index < 0)
+      return;
+    if (static_cast<std::size_t>(index) >= items.size())
+      items.resize(index + 1, none);
+    items[index] = value;
+  }
+
+  static uint32_t get_at(const std::vector<uint32_t>& items, int index,
+                         uint32_t none)
+  {
+    return index >= 0 && static_cast<std::size_t>(index) < items.size() ?
+      items[index] : none;
+  }
+
+  // Run STMT, a query for the symbol SYMBOL_ID named NAME yielding an id,
+  // path, line, column and line text per row.
+  std::vector<TagsDeclInfo> query_tags(sqlite3_stmt * stmt,
+                                       const std::string& name,
+                                       long symbol_id)
+  {
+    sql_chk(sqlite3_bind_int(stmt, 1, static_cast<int>(symbol_id)));
+
+    std::vector<TagsDeclInfo> tags;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+      TagsDeclInfo info;
+      info.name     = name;
+      info.id       = sqlite3_column_int(stmt, 0);
+      info.filename = sqlite3_column_string(stmt, 1);
+      info.line_no  = sqlite3_column_int(stmt, 2);
+      info.col_no   = sqlite3_column_int(stmt, 3);
+      info.text     = sqlite3_column_string(stmt, 4);
+      tags.push_back(info);
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+#ifdef HAVE_EXCEPTIONS
+    if (rc != SQLITE_DONE) {
+      std::cerr << "SQLite3 error: " << sqlite3_errmsg(database) << std::endl;
+      std::cerr << "Error occurred with the following query: "
+                << std::endl << sqlite3_sql(stmt) << std::endl;
+      throw std::runtime_error("SQLite3 query failed");
+    }
+#endif
+    return tags;
+  }
+};
+
+// A read-only TagsDatabase served from an index written by 'export'.  The
+// file is mapped rather than read, so opening it costs nothing and a query
+// touches only the pages of the records it binary-searches and returns.
+class MappedTagsDatabase : public TagsDatabase
+{
+  const char *               base;
+  std::size_t                size;
+  const MappedIndexHeader *  header;
+  const char *               strings;
+  const MappedFile *         files;
+  const MappedSymbol *       symbols;
+  const uint32_t *           by_short_name;
+  const MappedRef *          refs;
+  const uint32_t *           by_position;
+
+public:
+  explicit MappedTagsDatabase(const std::string& path)
+  {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0)
+      llvm::report_fatal_error("Cannot open " + path);
+    size = st.st_size;
+    void * mapping = size < sizeof(MappedIndexHeader) ? MAP_FAILED :
+      mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+      llvm::report_fatal_error(path + " is not an exported index");
+    base   = static_cast<const char *>(mapping);
+    header = reinterpret_cast<const MappedIndexHeader *>(base);
+
+    if (std::memcmp(header->magic, mapped_index_magic,
+                    sizeof header->magic) != 0 ||
+        header->version != mapped_index_version ||
+        ! section_fits(header->strings_offset, header->strings_size) ||
+        ! section_fits(header->files_offset,
+                       (header->file_count + 1ULL) * sizeof(MappedFile)) ||
+        ! section_fits(header->symbols_offset,
+                       header->symbol_count * 1ULL * sizeof(MappedSymbol)) ||
+        ! section_fits(header->by_short_name_offset,
+                       header->symbol_count * 1ULL * sizeof(uint32_t)) ||
+        ! section_fits(header->refs_offset,
+                       header->ref_count * 1ULL * sizeof(MappedRef)) ||
+        ! section_fits(header->by_position_offset,
+                       header->ref_count * 1ULL * sizeof(uint32_t)))
+      llvm::report_fatal_error(path + " is not a valid exported index");
+
+    strings       = base + header->strings_offset;
+    files         = section<MappedFile>(header->files_offset);
+    symbols       = section<MappedSymbol>(header->symbols_offset);
+    by_short_name = section<uint32_t>(header->by_short_name_offset);
+    refs          = section<MappedRef>(header->refs_offset);
+    by_position   = section<uint32_t>(header->by_position_offset);
+  }
+
+  ~MappedTagsDatabase() {
+    munmap(const_cast<char *>(base), size);
+  }
+
+  virtual long add_declaration(const TagsDeclRecord&) {
+    llvm::report_fatal_error("An exported index is read-only");
+  }
+  virtual void add_translation_unit(const TagsTranslationUnitRecord&) {
+    llvm::report_fatal_error("An exported index is read-only");
+  }
+
+  virtual std::vector<TagsDeclInfo> find_declaration(const std::string& name)
+  {
+    std::vector<TagsDeclInfo> tags;
+    const MappedSymbol * symbol = find_symbol(name);
+    if (symbol)
+      add_tags(tags, symbol, symbol->first_ref, symbol->declaration_count);
+    return tags;
+  }
+
+  virtual std::vector<TagsDeclInfo> find_references(const std::string& name)
+  {
+    std::vector<TagsDeclInfo> tags;
+    const MappedSymbol * symbol = find_symbol(name);
+    if (symbol)
+      add_tags(tags, symbol, symbol->first_ref + symbol->declaration_count,
+               symbol->use_count);
+    return tags;
+  }
+
+  // As SqliteTagsDatabase::complete, reading the candidates in order from
+  // the symbols sorted by short name without regard to case.
+  virtual std::vector<TagsCompletion> complete(const std::string& prefix,
+                                               unsigned limit)
+  {
+    const uint32_t * end = by_short_name + header->symbol_count;
+    const uint32_t * i   = std::lower_bound(by_short_name, end, prefix,
+                                            ShortNameBefore(*this));
+
+    std::vector<TagsCompletionCandidate> candidates;
+    for (; i != end && candidates.size() < CompletionCandidates; ++i) {
+      const MappedSymbol& symbol(symbols[*i]);
+      const char * short_name = pool_string(symbol.short_name);
+      std::size_t  length     = std::strlen(short_name);
+      if (length < prefix.size() ||
+          compare_nocase(short_name, prefix.data(), prefix.size()) != 0)
+        break;
+
+      TagsCompletionCandidate candidate;
+      candidate.id              = *i;
+      candidate.exact           = length == prefix.size();
+      candidate.case_match      =
+        std::memcmp(short_name, prefix.data(), prefix.size()) == 0;
+      candidate.completion.short_name.assign(short_name, length);
+      candidate.completion.full_name = pool_string(symbol.full_name);
+      candidates.push_back(candidate);
+    }
+
+    rank_completions(candidates, limit);
+
+    std::vector<TagsCompletion> completions;
+    for (std::vector<TagsCompletionCandidate>::iterator c =
+           candidates.begin();
+         c != candidates.end();
+         ++c) {
+      uint32_t kinds = symbols[(*c).id].kinds;
+      for (uint32_t kind = 1; kind < decl_kind_count; ++kind) {
+        if (! (kinds & (1U << kind)))
+          continue;
+        if (! (*c).completion.kinds.empty())
+          (*c).completion.kinds += ",";
+        (*c).completion.kinds += decl_kind_names[kind];
+      }
+      completions.push_back((*c).completion);
+    }
+    return completions;
+  }
+
+  // As SqliteTagsDatabase::find_at, reading the line's references from the
+  // file's run of the by-position array.
+  virtual std::vector<TagsDeclInfo>
+  find_at(const std::string& pathname, int line_no, int col_no)
+  {
+    std::vector<TagsDeclInfo> tags;
+    const MappedFile * files_end = files + header->file_count;
+    const MappedFile * file = std::lower_bound(files, files_end, pathname,
+                                               PathnameBefore(*this));
+    if (file == files_end || pathname != pool_string(file->pathname))
+      return tags;
+
+    const uint32_t * first = by_position + file->first_position;
+    const uint32_t * last  = by_position + (file + 1)->first_position;
+    const uint32_t * after = std::upper_bound(
+      first, last, std::make_pair(line_no, col_no), PositionBefore(*this));
+
+    std::set<uint32_t> spanning;
+    std::set<uint32_t> nearest;
+    int nearest_col_no = -1;
+    for (const uint32_t * i = after;
+         i != first && int(refs[*(i - 1)].line_no) == line_no;
+         --i) {
+      const MappedRef& ref(refs[*(i - 1)]);
+      int ref_col_no = ref.col_no;
+      if (col_no < ref_col_no +
+          int(std::strlen(pool_string(symbols[ref.symbol].short_name))))
+        spanning.insert(ref.symbol);
+      else if (nearest_col_no == -1 || nearest_col_no == ref_col_no) {
+        nearest_col_no = ref_col_no;
+        nearest.insert(ref.symbol);
+      }
+    }
+
+    const std::set<uint32_t>& found(spanning.empty() ? nearest : spanning);
+    for (std::set<uint32_t>::const_iterator i = found.begin();
+         i != found.end();
+         ++i)
+      add_tags(tags, &symbols[*i], symbols[*i].first_ref,
+               symbols[*i].declaration_count);
+    return tags;
+  }
+
+  // As SqliteTagsDatabase::find_members.  The members of a scope are among
+  // the run of symbols whose full names start with it and "::", and are
+  // those with no further scope after that.
+  virtual std::vector<TagsDeclInfo> find_members(const std::string& scope)
+  {
+    std::vector<TagsDeclInfo> tags;
+    std::string prefix(scope.empty() ? scope : scope + "::");
+    for (uint32_t i = lower_bound_symbol(prefix);
+         i < header->symbol_count;
+         ++i) {
+      const char * full_name = pool_string(symbols[i].full_name);
+      if (std::strncmp(full_name, prefix.c_str(), prefix.size()) != 0)
+        break;
+      if (find_scope_separator(full_name + prefix.size()) ==
+          llvm::StringRef::npos)
+        add_tags(tags, &symbols[i], symbols[i].first_ref,
+                 symbols[i].declaration_count);
+    }
+    return tags;
+  }
+
+private:
+  bool section_fits(uint64_t offset, uint64_t length) const {
+    return offset % 8 == 0 && offset <= size && length <= size - offset;
+  }
+
+  template <typename T>
+  const T * section(uint64_t offset) const {
+    return reinterpret_cast<const T *>(base + offset);
+  }
+
+  const char * pool_string(uint32_t offset) const {
+    return strings + offset;
+  }
+
+  const MappedSymbol * find_symbol(const std::string& name) const
+  {
+    uint32_t i = lower_bound_symbol(name);
+    if (i < header->symbol_count &&
+        name == pool_string(symbols[i].full_name))
+      return &symbols[i];
+    return NULL;
+  }
+
+  // Binary search the symbols for the first whose full name is not before
+  // NAME.  Only probes whose inline prefix matches NAME's need to look at
+  // the string pool.
+  uint32_t lower_bound_symbol(const std::string& name) const
+  {
+    char prefix[sizeof symbols->prefix] = { 0 };
+    std::memcpy(prefix, name.data(), std::min(name.size(), sizeof prefix));
+
+    uint32_t low  = 0;
+    uint32_t high = header->symbol_count;
+    while (low < high) {
+      uint32_t middle = low + (high - low) / 2;
+      const MappedSymbol& symbol(symbols[middle]);
+      int diff = std::memcmp(symbol.prefix, prefix, sizeof prefix);
+      if (! diff)
+        diff = std::strcmp(pool_string(symbol.full_name), name.c_str());
+      if (diff < 0)
+        low = middle + 1;
+      else
+        high = middle;
+    }
+    return low;
+  }
+
+  void add_tags(std::vector<TagsDeclInfo>& tags, const MappedSymbol * symbol,
+                uint32_t first, uint32_t count) const
+  {
+    for (const MappedRef * ref = refs + first;
+         ref != refs + first + count;
+         ++ref) {
+      TagsDeclInfo info;
+      info.id       = static_cast<int>(symbol - symbols);
+      info.name     = pool_string(symbol->full_name);
+      info.filename = pool_string(files[ref->file].pathname);
+      info.line_no  = ref->line_no;
+      info.col_no   = ref->col_no;
+      info.text     = pool_string(ref->text);
+      tags.push_back(info);
+    }
+  }
+
+  struct ShortNameBefore
+  {
+    const MappedTagsDatabase& db;
+
+    explicit ShortNameBefore(const MappedTagsDatabase& db) : db(db) {}
+
+    bool operator()(uint32_t symbol, const std::string& prefix) const {
+      const char * name   = db.pool_string(db.symbols[symbol].short_name);
+      std::size_t  length = std::strlen(name);
+      int diff = compare_nocase(name, prefix.data(),
+                                std::min(length, prefix.size()));
+      return diff ? diff < 0 : length < prefix.size();
+    }
+  };
+
+  struct PathnameBefore
+  {
+    const MappedTagsDatabase& db;
+
+    explicit PathnameBefore(const MappedTagsDatabase& db) : db(db) {}
+
+    bool operator()(const MappedFile& file,
+                    const std::string& pathname) const {
+      return std::strcmp(db.pool_string(file.pathname),
+                         pathname.c_str()) < 0;
+    }
+  };
+
+  struct PositionBefore
+  {
+    const MappedTagsDatabase& db;
+
+    explicit PositionBefore(const MappedTagsDatabase& db) : db(db) {}
+
+    bool operator()(const std::pair<int, int>& position,
+                    uint32_t index) const {
+      const MappedRef& ref(db.refs[index]);
+      if (position.first != int(ref.line_no))
+        return position.first < int(ref.line_no);
+      return position.second < int(ref.col_no);
+    }
+  };
+};
+
+// The offsets at which each line of a source buffer begins, found in one
+// memchr pass so that the text of any line can be sliced out in O(1).
+class LineIndex
+{
+  const char *          start;
+  const char *          end;
+  std::vector<unsigned> line_starts;
+
+public:
+  LineIndex(const char * start, const char * end) : start(start), end(end)
+  {
+    line_starts.reserve((end - start) / 32);
+    line_starts.push_back(0);
+    for (const char * p = start;
+         (p = static_cast<const char *>(std::memchr(p, '\n', end - p)));
+         ++p)
+      line_starts.push_back(p + 1 - start);
+  }
+
+  // The text of line LINE_NO, counting from 1, without its newline.
+  llvm::StringRef line(unsigned line_no) const
+  {
+    if (line_no == 0 || line_no > line_starts.size())
+      return llvm::StringRef();
+    const char * line_begin = start + line_starts[line_no - 1];
+    const char * line_end   = line_no < line_starts.size() ?
+      start + line_starts[line_no] - 1 : end;
+    return llvm::StringRef(line_begin, line_end - line_begin);
+  }
+};
+
+// Turns declarations into TagsDeclRecords, keeping for each file of the
+// translation unit its identity, canonical path and a LineIndex, so that
+// every file is resolved and scanned for newlines at most once.
+class TagsDeclExtractor
+{
+  struct FileInfo
+  {
+    TagsFileIdentity                  identity;
+    const CanonicalPathCache::Entry * path;
+    LineIndex *                       line_index;
+
+    FileInfo() : path(NULL), line_index(NULL) {}
+  };
+
+  std::map<FileID, FileInfo> files;
+
+public:
+  ~TagsDeclExtractor() {
+    for (std::map<FileID, FileInfo>::iterator i = files.begin();
+         i != files.end();
+         ++i)
+      delete (*i).second.line_index;
+  }
+
+  // Fill in RECORD from DECLARATION, returning false if the declaration
+  // has no name or no location in a real file and so should not be
+  // indexed.
+  bool extract(NamedDecl *Declaration, TagsDeclRecord& record);
+
+  // Fill in RECORD as a use of DECLARATION at LOCATION, returning false if
+  // it should not be indexed.
+  bool extract_use(NamedDecl *Declaration, SourceLocation Location,
+                   TagsDeclRecord& record);
+
+  // Fill in RECORD as the definition or an expansion of the macro NAME at
+  // LOCATION, returning false if it should not be indexed.
+  bool extract_macro(SourceManager& SM, llvm::StringRef Name,
+                     SourceLocation Location, bool definition,
+                     TagsDeclRecord& record);
+
+private:
+  bool describe(NamedDecl *Declaration, TagsDeclRecord& record);
+  bool locate(SourceManager& SM, SourceLocation Location,
+              TagsDeclRecord& record);
+};
+
+bool TagsDeclExtractor::extract(NamedDecl *Declaration,
+                                TagsDeclRecord& record)
+{
+  if (! describe(Declaration, record))
+    return false;
+
+  record.ref_kind_id = record.is_definition ? 1 : 2;
+  return locate(Declaration->getASTContext().getSourceManager(),
+                Declaration->getLocStart(), record);
+}
+
+bool TagsDeclExtractor::extract_use(NamedDecl *Declaration,
+                                    SourceLocation Location,
+                                    TagsDeclRecord& record)
+{
+  if (! Declaration || ! describe(Declaration, record))
+    return false;
+
+  // A use refers to the symbol, not to whichever of its declarations the
+  // compiler happened to find.
+  record.is_definition = 0;
+  record.is_implicit   = 0;
+  record.ref_kind_id   = 3;
+
+  // Uses written as macro arguments are found where they were spelled.
+  SourceManager& SM(Declaration->getASTContext().getSourceManager());
+  return locate(SM, SM.getSpellingLoc(Location), record);
+}
+
+bool TagsDeclExtractor::extract_macro(SourceManager& SM,
+                                      llvm::StringRef Name,
+                                      SourceLocation Location,
+                                      bool definition,
+                                      TagsDeclRecord& record)
+{
+  record.short_name    = Name;
+  record.full_name     = Name;
+  record.kind_id       = 5;
+  record.is_definition = definition;
+  record.is_implicit   = 0;
+  record.ref_kind_id   = definition ? 1 : 3;
+  record.context_ref   = 0;
+  return locate(SM, Location, record);
+}
+
+// Fill in the names and kind of DECLARATION.
+bool TagsDeclExtractor::describe(NamedDecl *Declaration,
+                                 TagsDeclRecord& record)
+{
+  if (Declaration->getNameAsString().empty())
+    return false;
+
+  int decl_kind_id  = 1;
+  int is_implicit   = 0;
+  int is_definition = 0;
+
+  if (isa<FunctionDecl>(Declaration)) {
+    if (isa<CXXConstructorDecl>(Declaration)) {
+      CXXConstructorDecl * ctorDecl = cast<CXXConstructorDecl>(Declaration);
+      decl_kind_id  = 1;
+      is_definition = ctorDecl->isThisDeclarationADefinition();
+      is_implicit   = is_definition && ctorDecl->isImplicitlyDefined();
+    }
+    else if (isa<CXXDestructorDecl>(Declaration)) {
+      CXXDestructorDecl * dtorDecl = cast<CXXDestructorDecl>(Declaration);
+      decl_kind_id  = 1;
+      is_definition = dtorDecl->isThisDeclarationADefinition();
+      is_implicit   = is_definition && dtorDecl->isImplicitlyDefined();
+    }
+    else {
+      FunctionDecl * functionDecl = cast<FunctionDecl>(Declaration);
+      decl_kind_id  = 1;
+      is_definition = functionDecl->isThisDeclarationADefinition();
+    }
+  }
+  else if (isa<TagDecl>(Declaration)) {
+    TagDecl * tagDecl = cast<TagDecl>(Declaration);
+    decl_kind_id  = 2;        // jww (2012-05-23): What about enums?
+    is_definition = tagDecl->isThisDeclarationADefinition();
+  }
+  else if (isa<VarDecl>(Declaration)) {
+    VarDecl * varDecl = cast<VarDecl>(Declaration);
+    decl_kind_id  = 3;
+    is_definition = varDecl->isThisDeclarationADefinition();
+  }
+
+  record.short_name    = Declaration->getNameAsString();
+  record.full_name     = Declaration->getQualifiedNameAsString();
+  record.kind_id       = decl_kind_id;
+  record.is_definition = is_definition;
+  record.is_implicit   = is_implicit;
+  record.context_ref   = 0;
+  return true;
+}
+
+// Fill in the file, line and column of LOCATION.
+bool TagsDeclExtractor::locate(SourceManager& SM, SourceLocation Location,
+                               TagsDeclRecord& record)
+{
+  FullSourceLoc FullLocation(Location, SM);
+  if (!FullLocation.isValid())
+    return false;
+
+  FileID file_id = FullLocation.getFileID();
+  FileInfo& file(files[file_id]);
+  if (! file.line_index) {
+    const FileEntry * file_entry =
+      FullLocation.getManager().getFileEntryForID(file_id);
+    if (!file_entry)
+      return false;
+
+    bool InvalidFile = false;
+    const llvm::MemoryBuffer * Buffer =
+      FullLocation.getManager().getBuffer(file_id, &InvalidFile);
+    if (InvalidFile || !Buffer)
+      return false;
+
+    file.identity   = file_identity(file_entry);
+    file.path       = &SourcePathCache.lookup(file_entry);
+    file.line_index = new LineIndex(Buffer->getBufferStart(),
+                                    Buffer->getBufferEnd());
+  }
+
+  record.dirname       = file.path->dirname;
+  record.pathname      = file.path->pathname;
+  record.file          = file.identity;
+  record.line_no       = FullLocation.getSpellingLineNumber();
+  record.col_no        = FullLocation.getSpellingColumnNumber();
+  record.line_text     = file.line_index->line(record.line_no);
+  return true;
+}
+
+class TagsClassVisitor : public RecursiveASTVisitor<TagsClassVisitor>
+{
+  TagsDeclSink&     tags_db;
+  TagsDeclExtractor extractor;
+
+  // Every file seen in this translation unit, and in header-dedup mode the
+  // files already indexed and whether each file's declarations are skipped.
+  std::map<const FileEntry *, TagsFileRecord> file_records;
+  IndexedFileSet *                            indexed_files;
+  std::map<FileID, bool>                      skipped_files;
+
+  // The sink's handle for the innermost function, method or record being
+  // traversed, which is recorded as the context of every declaration and
+  // use found within it.
+  long context_ref;
+
+  IndexTier tier;
+
+  // Whether to time the sink, which is only done for --stats.
+  bool timed;
+
+  // The macros seen while preprocessing, waiting for store_macros.
+  struct PendingMacro
+  {
+    llvm::StringRef name;
+    SourceLocation  location;
+    bool            definition;
+
+    PendingMacro(llvm::StringRef name, SourceLocation location,
+                 bool definition)
+      : name(name), location(location), definition(definition) {}
+  };
+  std::vector<PendingMacro> pending_macros;
+
+public:
+  // Time spent in the sink, and the records given to it.
+  double   store_seconds;
+  unsigned records_stored;
+
+  TagsClassVisitor(TagsDeclSink& db, IndexedFileSet * indexed_files,
+                   IndexTier tier, bool timed)
+    : tags_db(db), indexed_files(indexed_files), context_ref(0), tier(tier),
+      timed(timed), store_seconds(0), records_stored(0) {}
+  virtual ~TagsClassVisitor() {}
+
+  bool TraverseDecl(Decl *Declaration) {
+    // Namespaces and linkage specifications may enclose declarations from
+    // other files, so only their own entries are skipped, not their bodies.
+    if (Declaration && indexed_files && is_skipped(Declaration) &&
+        ! isa<NamespaceDecl>(Declaration) &&
+        ! isa<LinkageSpecDecl>(Declaration) &&
+        ! isa<TranslationUnitDecl>(Declaration))
+      return true;
+
+    // The declarations tier stops at anything local to a function.
+    if (Declaration && tier == TierDeclarations && ! is_outer(Declaration))
+      return true;
+
+    long enclosing_ref = context_ref;
+    bool result =
+      RecursiveASTVisitor<TagsClassVisitor>::TraverseDecl(Declaration);
+    context_ref = enclosing_ref;
+    return result;
+  }
+
+  bool VisitNamedDecl(NamedDecl *Declaration) {
+    if (indexed_files && is_skipped(Declaration))
+      return true;
+
+    TagsDeclRecord record;
+    if (extractor.extract(Declaration, record)) {
+      record.context_ref = context_ref;
+      long handle = store(record);
+      if (is_context(Declaration))
+        context_ref = handle;
+    }
+    return true;
+  }
+
+  bool VisitDeclRefExpr(DeclRefExpr *Expression) {
+    add_use(Expression->getDecl(), Expression->getLocation());
+    return true;
+  }
+
+  bool VisitMemberExpr(MemberExpr *Expression) {
+    add_use(Expression->getMemberDecl(), Expression->getMemberLoc());
+    return true;
+  }
+
+  // Calls whose callee is named by a DeclRefExpr or MemberExpr have
+  // already been recorded as uses of it.
+  bool VisitCallExpr(CallExpr *Expression) {
+    Expr * Callee = Expression->getCallee();
+    if (Callee) {
+      Callee = Callee->IgnoreParenImpCasts();
+      if (isa<DeclRefExpr>(Callee) || isa<MemberExpr>(Callee))
+        return true;
+    }
+    add_use(dyn_cast_or_null<NamedDecl>(Expression->getCalleeDecl()),
+            Expression->getLocStart());
+    return true;
+  }
+
+  bool VisitTagTypeLoc(TagTypeLoc Type) {
+    add_use(Type.getDecl(), Type.getNameLoc());
+    return true;
+  }
+
+  bool VisitTypedefTypeLoc(TypedefTypeLoc Type) {
+    add_use(Type.getTypedefNameDecl(), Type.getNameLoc());
+    return true;
+  }
+
+  // Note the definition of the macro NAME at LOCATION, or an expansion of
+  // it.  Only definitions are indexed at the declarations tier.
+  void add_macro(llvm::StringRef Name, SourceLocation Location,
+                 bool definition)
+  {
+    if (definition || tier != TierDeclarations)
+      pending_macros.push_back(PendingMacro(Name, Location, definition));
+  }
+
+  // Record the macros noted while preprocessing.  They are held until the
+  // translation unit is traversed so that, with header dedup, which files
+  // are skipped is decided at the same point for them as for declarations.
+  void store_macros(SourceManager& SM)
+  {
+    for (std::vector<PendingMacro>::const_iterator i =
+           pending_macros.begin();
+         i != pending_macros.end();
+         ++i) {
+      if (indexed_files && is_skipped(SM, (*i).location))
+        continue;
+
+      TagsDeclRecord record;
+      if (extractor.extract_macro(SM, (*i).name, (*i).location,
+                                  (*i).definition, record))
+        store(record);
+    }
+    pending_macros.clear();
+  }
+
+  // Called once the whole translation unit has been traversed, to record
+  // which files it included.  Each of them is now fully indexed.
+  void finish_translation_unit(SourceManager& SM)
+  {
+    const FileEntry * main_entry = SM.getFileEntryForID(SM.getMainFileID());
+    const TagsFileRecord * main_file = file_record(SM, main_entry);
+    if (! main_file)
+      return;
+
+    TagsTranslationUnitRecord unit;
+    unit.main_file = *main_file;
+    unit.tier      = tier;
+    if (indexed_files)
+      indexed_files->insert(main_entry, main_file->content_hash);
+
+    // The files read from a precompiled preamble are only known to the
+    // source manager once their entries have been loaded.
+    for (unsigned i = 0; i < SM.loaded_sloc_entry_size(); ++i)
+      SM.getLoadedSLocEntry(i);
+
+    for (SourceManager::fileinfo_iterator i = SM.fileinfo_begin();
+         i != SM.fileinfo_end();
+         ++i) {
+      const FileEntry * file_entry = (*i).first;
+      if (file_entry == main_entry)
+        continue;
+
+      const TagsFileRecord * file = file_record(SM, file_entry);
+      if (! file)
+        continue;
+
+      unit.included_files.push_back(*file);
+      if (indexed_files)
+        indexed_files->insert(file_entry, file->content_hash);
+    }
+
+    double start = timed ? current_time() : 0;
+    tags_db.add_translation_unit(unit);
+    if (timed)
+      store_seconds += current_time() - start;
+  }
+
+private:
+  long store(const TagsDeclRecord& record)
+  {
+    double start = timed ? current_time() : 0;
+    long handle = tags_db.add_declaration(record);
+    if (timed)
+      store_seconds += current_time() - start;
+    ++records_stored;
+    return handle;
+  }
+
+  void add_use(NamedDecl *Declaration, SourceLocation Location)
+  {
+    if (tier == TierDeclarations)
+      return;
+
+    TagsDeclRecord record;
+    if (extractor.extract_use(Declaration, Location, record)) {
+      record.context_ref = context_ref;
+      store(record);
+    }
+  }
+
+  const TagsFileRecord * file_record(SourceManager& SM,
+                                     const FileEntry * file_entry)
+  {
+    if (! file_entry)
+      return NULL;
+
+    std::map<const FileEntry *, TagsFileRecord>::iterator i =
+      file_records.find(file_entry);
+    if (i != file_records.end())
+      return &(*i).second;
+
+    bool InvalidFile = false;
+    const llvm::MemoryBuffer * Buffer =
+      SM.getMemoryBufferForFile(file_entry, &InvalidFile);
+    if (InvalidFile || ! Buffer)
+      return NULL;
+
+    const CanonicalPathCache::Entry& path(SourcePathCache.lookup(file_entry));
+    TagsFileRecord& file(file_records[file_entry]);
+    file.dirname      = path.dirname;
+    file.pathname     = path.pathname;
+    file.file         = file_identity(file_entry);
+    file.mtime        = file_entry->getModificationTime();
+    file.size         = file_entry->getSize();
+    file.content_hash = hash_contents(Buffer->getBufferStart(),
+                                      Buffer->getBufferEnd());
+    return &file;
+  }
+
+  // Whether DECLARATION is reported as the context of what it encloses.
+  // Locals and parameters are not: a use within them belongs to their
+  // function.
+  static bool is_context(Decl *Declaration)
+  {
+    return isa<FunctionDecl>(Declaration) || isa<RecordDecl>(Declaration);
+  }
+
+  // Whether DECLARATION is declared at namespace or class scope (including
+  // as an enumerator), rather than within a function.
+  static bool is_outer(Decl *Declaration)
+  {
+    DeclContext * Context = Declaration->getDeclContext();
+    if (! Context)
+      return true;
+    Context = Context->getRedeclContext();
+    return Context->isFileContext() || Context->isRecord() ||
+      Context->getDeclKind() == Decl::Enum;
+  }
+
+  bool is_skipped(Decl *Declaration)
+  {
+    return is_skipped(Declaration->getASTContext().getSourceManager(),
+                      Declaration->getLocation());
+  }
+
+  bool is_skipped(SourceManager& SM, SourceLocation Location)
+  {
+    if (Location.isInvalid())
+      return false;
+
+    FileID file_id = SM.getFileID(SM.getExpansionLoc(Location));
+
+    std::map<FileID, bool>::iterator i = skipped_files.find(file_id);
+    if (i != skipped_files.end())
+      return (*i).second;
+
+    const FileEntry * file_entry = SM.getFileEntryForID(file_id);
+    const TagsFileRecord * file = file_record(SM, file_entry);
+    bool skipped =
+      file && indexed_files->contains(file_entry, file->pathname,
+                                      file->content_hash);
+
+    skipped_files.insert(std::make_pair(file_id, skipped));
+    return skipped;
+  }
+};
+
+// Holds a translation unit that has been parsed back from being traversed
+// until it is its turn.
+class TagsTraversalGate
+{
+public:
+  virtual ~TagsTraversalGate() {}
+
+  virtual void wait() = 0;
+};
+
+// The consumer is created before the source is parsed and handed the AST
+// once parsing is done, so its lifetime brackets the parse.  The macros
+// found while parsing have already been noted by VISITOR.
+class TagsClassConsumer : public ASTConsumer
+{
+public:
+  TagsClassConsumer(TagsClassVisitor& Visitor, IndexStatistics * statistics,
+                    llvm::StringRef source, TagsTraversalGate * gate)
+    : Visitor(Visitor), statistics(statistics), source(source), gate(gate),
+      start(current_time()) {}
+  virtual ~TagsClassConsumer() {}
+
+  virtual void HandleTranslationUnit(ASTContext& Context) {
+    double parsed = current_time();
+    if (gate)
+      gate->wait();
+
+    double traversing = current_time();
+    Visitor.store_macros(Context.getSourceManager());
+    Visitor.TraverseDecl(Context.getTranslationUnitDecl());
+    Visitor.finish_translation_unit(Context.getSourceManager());
+
+    if (statistics) {
+      IndexStatistics::UnitTiming timing;
+      timing.source           = source;
+      timing.parse_seconds    = parsed - start;
+      timing.traverse_seconds =
+        current_time() - traversing - Visitor.store_seconds;
+      timing.store_seconds    = Visitor.store_seconds;
+      timing.records          = Visitor.records_stored;
+      statistics->add_unit(timing);
+    }
+  }
+
+private:
+  TagsClassVisitor&   Visitor;
+  IndexStatistics *   statistics;
+  std::string         source;
+  TagsTraversalGate * gate;
+  double              start;
+};
+
+// Indexes the macros of a translation unit as the preprocessor defines and
+// expands them.  An expansion within another macro's body is not indexed,
+// since it was not written there; one within a macro's arguments is, where
+// it was spelled.
+class TagsMacroCallbacks : public PPCallbacks
+{
+  Preprocessor&      PP;
+  TagsClassVisitor&  Visitor;
+  std::set<unsigned> argument_expansions;
+
+public:
+  TagsMacroCallbacks(Preprocessor& PP, TagsClassVisitor& Visitor)
+    : PP(PP), Visitor(Visitor) {}
+
+  virtual void MacroDefined(const Token& MacroNameTok,
+                            const MacroInfo *Macro) {
+    if (! Macro->isBuiltinMacro())
+      Visitor.add_macro(name(MacroNameTok), MacroNameTok.getLocation(),
+                        true);
+  }
+
+  virtual void MacroExpands(const Token& MacroNameTok,
+                            const MacroInfo *Macro, SourceRange) {
+    if (Macro->isBuiltinMacro())
+      return;
+
+    SourceManager& SM(PP.getSourceManager());
+    SourceLocation Location = MacroNameTok.getLocation();
+    if (Location.isMacroID()) {
+      if (! SM.isMacroArgExpansion(Location))
+        return;
+      // An argument may be expanded more than once.
+      Location = SM.getSpellingLoc(Location);
+      if (! argument_expansions.insert(Location.getRawEncoding()).second)
+        return;
+    }
+    Visitor.add_macro(name(MacroNameTok), Location, false);
+  }
+
+  // The macros of a precompiled preamble were defined when it was built,
+  // not while parsing, so they are read back from it here.
+  virtual void EndOfMainFile() {
+    for (Preprocessor::macro_iterator i = PP.macro_begin();
+         i != PP.macro_end();
+         ++i)
+      if ((*i).second->isFromAST())
+        Visitor.add_macro((*i).first->getName(),
+                          (*i).second->getDefinitionLoc(), true);
+  }
+
+private:
+  static llvm::StringRef name(const Token& Tok) {
+    return Tok.getIdentifierInfo()->getName();
+  }
+};
+
+// Precompiles a preamble header to OUTPUT.
+class TagsPreambleAction : public GeneratePCHAction
+{
+  std::string output;
+
+public:
+  explicit TagsPreambleAction(const std::string& output) : output(output) {}
+
+protected:
+  virtual bool BeginSourceFileAction(CompilerInstance& CI,
+                                     llvm::StringRef Filename) {
+    CI.getFrontendOpts().OutputFile = output;
+    return GeneratePCHAction::BeginSourceFileAction(CI, Filename);
+  }
+};
+
+class TagsPreambleActionFactory : public FrontendActionFactory
+{
+  std::string output;
+
+public:
+  explicit TagsPreambleActionFactory(const std::string& output)
+    : output(output) {}
+
+  virtual FrontendAction *create() {
+    return new TagsPreambleAction(output);
+  }
+};
+
+// A compilation database that lets translation units share precompiled
+// preambles.  Sources whose commands are the same apart from the source
+// and output files are grouped by the #include lines they start with (see
+// leading_includes), and the longest run of them shared with at least one
+// other source in the group is written to a header and precompiled once.
+// Each such source's command then gets -include-pch, and TagsClassAction
+// has the preprocessor skip the directives in the main file, as clang
+// does for its own precompiled preambles.
+//
+// Every other source is parsed as usual, as are the sources of a preamble
+// that fails to build, and a source whose parse fails with its preamble is
+// handed back by take_fallback to be parsed again without it.
+class PreambleCompilationDatabase : public CompilationDatabase
+{
+  struct Preamble
+  {
+    std::string              header;
+    std::string              pch;
+    std::string              directory;
+    std::vector<std::string> command_line;
+  };
+
+  struct Source
+  {
+    std::size_t preamble;
+    unsigned    bytes;
+    bool        enabled;
+    bool        failed;
+  };
+
+  // A source considered for a preamble.  FLAGS is its command line
+  // without the source and output files, to be run in BUILD_DIRECTORY.
+  struct Candidate
+  {
+    std::string               path;
+    std::string               name;
+    std::string               directory;
+    std::string               build_directory;
+    std::string               language;
+    std::vector<std::string>  flags;
+    std::string               key;
+    std::vector<std::string>  includes;
+    std::vector<std::size_t>  ends;
+  };
+
+  const CompilationDatabase&         base;
+  std::string                        directory;
+  std::vector<Preamble>              preambles;
+  std::map<std::string, std::size_t> headers;
+  std::map<std::string, Source>      sources;
+  std::map<std::string, std::string> source_paths;
+  mutable pthread_mutex_t            lock;
+
+public:
+  // Preambles are written to DIRECTORY, which is created if need be and
+  // removed again along with them.
+  PreambleCompilationDatabase(const CompilationDatabase& base,
+                              const std::string& directory)
+    : base(base),
+      directory(directory[0] == '/' ? directory :
+                canonical_path(".") + "/" + directory) {
+    pthread_mutex_init(&lock, NULL);
+  }
+
+  ~PreambleCompilationDatabase() {
+    for (std::vector<Preamble>::const_iterator i = preambles.begin();
+         i != preambles.end();
+         ++i) {
+      unlink((*i).header.c_str());
+      unlink((*i).pch.c_str());
+    }
+    rmdir(directory.c_str());
+    pthread_mutex_destroy(&lock);
+  }
+
+  // Plan and build the preambles for SOURCE_NAMES, paths relative to the
+  // current directory, returning the number of sources that will use one.
+  std::size_t build(const std::vector<std::string>& source_names)
+  {
+    std::string cwd(canonical_path("."));
+    std::vector<Candidate> candidates;
+    std::map<std::string, unsigned> users;
+    for (std::vector<std::string>::const_iterator i = source_names.begin();
+         i != source_names.end();
+         ++i) {
+      Candidate candidate;
+      candidate.name = *i;
+      std::string absolute((*i)[0] == '/' ? *i : cwd + "/" + *i);
+      candidate.path = canonical_path(absolute);
+      candidate.directory =
+        candidate.path.substr(0, candidate.path.rfind('/') + 1);
+      candidate.language = header_language(candidate.path);
+
+      std::vector<CompileCommand> commands(
+        base.getCompileCommands(absolute));
+      std::string text;
+      if (commands.size() != 1 ||
+          ! strip_command(commands[0], candidate.path, candidate.flags) ||
+          ! read_file(candidate.path, text))
+        continue;
+      candidate.includes = leading_includes(text, candidate.ends);
+      if (candidate.includes.empty())
+        continue;
+
+      candidate.build_directory = commands[0].Directory;
+      candidate.key = candidate.build_directory;
+      candidate.key += '\0';
+      candidate.key += candidate.language;
+      for (std::vector<std::string>::const_iterator j =
+             candidate.flags.begin();
+           j != candidate.flags.end();
+           ++j) {
+        candidate.key += '\0';
+        candidate.key += *j;
+      }
+
+      std::string prefix;
+      for (std::size_t n = 0; n < candidate.includes.size(); ++n)
+        ++users[extend_prefix(candidate, n, prefix)];
+      candidates.push_back(candidate);
+    }
+
+    // Each source takes the longest run of its directives that another
+    // source shares; runs then taken by a single source are dropped.
+    std::map<std::string, std::vector<std::size_t> > groups;
+    std::vector<std::size_t> lengths(candidates.size(), 0);
+    for (std::size_t i = 0; i < candidates.size(); ++i) {
+      std::string prefix;
+      std::string chosen;
+      for (std::size_t n = 0; n < candidates[i].includes.size(); ++n) {
+        if (users[extend_prefix(candidates[i], n, prefix)] < 2)
+          break;
+        chosen     = prefix;
+        lengths[i] = n + 1;
+      }
+      if (lengths[i])
+        groups[chosen].push_back(i);
+    }
+
+    if (! groups.empty() && mkdir(directory.c_str(), 0777) != 0 &&
+        errno != EEXIST)
+      llvm::report_fatal_error("Cannot create " + directory);
+
+    std::size_t enabled = 0;
+    for (std::map<std::string, std::vector<std::size_t> >::const_iterator
+           i = groups.begin();
+         i != groups.end();
+         ++i) {
+      const std::vector<std::size_t>& members((*i).second);
+      if (members.size() < 2)
+        continue;
+
+      const Candidate& first(candidates[members.front()]);
+      std::size_t      length = lengths[members.front()];
+      if (! build_preamble(first, length))
+        continue;
+
+      for (std::vector<std::size_t>::const_iterator j = members.begin();
+           j != members.end();
+           ++j) {
+        Source source;
+        source.preamble = preambles.size() - 1;
+        source.bytes    = candidates[*j].ends[length - 1];
+        source.enabled  = true;
+        source.failed   = false;
+        sources[candidates[*j].path]      = source;
+        source_paths[candidates[*j].name] = candidates[*j].path;
+      }
+      enabled += members.size();
+    }
+
+    // ClangTool leaves the process in the directory of the last command it
+    // ran, which would change the meaning of relative source paths.
+    if (chdir(cwd.c_str()) != 0)
+      llvm::report_fatal_error("Cannot return to " + cwd);
+    return enabled;
+  }
+
+  std::size_t preamble_count() const {
+    return preambles.size();
+  }
+
+  virtual std::vector<CompileCommand>
+  getCompileCommands(llvm::StringRef FilePath) const
+  {
+    std::string path(canonical_path(FilePath.str()));
+    std::map<std::string, std::size_t>::const_iterator header =
+      headers.find(path);
+    if (header != headers.end()) {
+      const Preamble& preamble(preambles[(*header).second]);
+      CompileCommand command;
+      command.Directory   = preamble.directory;
+      command.CommandLine = preamble.command_line;
+      return std::vector<CompileCommand>(1, command);
+    }
+
+    std::vector<CompileCommand> commands(base.getCompileCommands(FilePath));
+    pthread_mutex_lock(&lock);
+    std::map<std::string, Source>::const_iterator source =
+      sources.find(path);
+    if (source != sources.end() && (*source).second.enabled &&
+        commands.size() == 1) {
+      std::vector<std::string>& command_line(commands[0].CommandLine);
+      const std::string& pch(preambles[(*source).second.preamble].pch);
+      command_line.insert(command_line.begin() + 1, pch);
+      command_line.insert(command_line.begin() + 1, "-include-pch");
+    }
+    pthread_mutex_unlock(&lock);
+    return commands;
+  }
+
+  // The number of bytes at the start of the main file FILENAME that the
+  // preamble PCH stands for, or zero if it has none.  PATH receives the
+  // file's canonical path.
+  unsigned preamble_bytes(const std::string& filename, const std::string& pch,
+                          std::string& path) const
+  {
+    if (pch.empty())
+      return 0;
+
+    path = canonical_path(filename);
+    unsigned bytes = 0;
+    pthread_mutex_lock(&lock);
+    std::map<std::string, Source>::const_iterator source =
+      sources.find(path);
+    if (source != sources.end() && (*source).second.enabled &&
+        preambles[(*source).second.preamble].pch == pch)
+      bytes = (*source).second.bytes;
+    pthread_mutex_unlock(&lock);
+    return bytes;
+  }
+
+  // The source at PATH could not be parsed with its preamble.
+  void preamble_failed(const std::string& path)
+  {
+    pthread_mutex_lock(&lock);
+    std::map<std::string, Source>::iterator source = sources.find(path);
+    if (source != sources.end() && (*source).second.enabled) {
+      (*source).second.enabled = false;
+      (*source).second.failed  = true;
+    }
+    pthread_mutex_unlock(&lock);
+  }
+
+  // Whether the source named NAME, as passed to build, failed to parse
+  // with its preamble and has not been handed back before.
+  bool take_fallback(const std::string& name)
+  {
+    std::map<std::string, std::string>::const_iterator path =
+      source_paths.find(name);
+    if (path == source_paths.end())
+      return false;
+
+    pthread_mutex_lock(&lock);
+    Source& source(sources[(*path).second]);
+    bool failed = source.failed;
+    source.failed = false;
+    pthread_mutex_unlock(&lock);
+    return failed;
+  }
+
+private:
+  // Append the Nth directive of CANDIDATE to PREFIX, the key of the run
+  // before it, and return the result.  Quoted includes are looked for
+  // first beside the source, so a run containing one is only shared by
+  // sources in the same directory.
+  static const std::string& extend_prefix(const Candidate& candidate,
+                                          std::size_t n, std::string& prefix)
+  {
+    if (n == 0)
+      prefix = candidate.key;
+    if (candidate.includes[n][9] == '"' && ! has_quoted(candidate, n)) {
+      prefix += '\0';
+      prefix += candidate.directory;
+    }
+    prefix += '\n';
+    prefix += candidate.includes[n];
+    return prefix;
+  }
+
+  // Whether any of the first N directives of CANDIDATE is a quoted
+  // include.
+  static bool has_quoted(const Candidate& candidate, std::size_t n)
+  {
+    for (std::size_t i = 0; i < n; ++i)
+      if (candidate.includes[i][9] == '"')
+        return true;
+    return false;
+  }
+
+  static const char * header_language(const std::string& path)
+  {
+    std::string extension(path.substr(path.rfind('.') + 1));
+    if (extension == "c")
+      return "c-header";
+    if (extension == "m")
+      return "objective-c-header";
+    if (extension == "mm")
+      return "objective-c++-header";
+    return "c++-header";
+  }
+
+  // Copy COMMAND's command line to FLAGS without the source file at PATH
+  // and the options naming output files, which differ between otherwise
+  // identical commands.  Returns false unless PATH appears exactly once.
+  static bool strip_command(const CompileCommand& command,
+                            const std::string& path,
+                            std::vector<std::string>& flags)
+  {
+    const std::vector<std::string>& command_line(command.CommandLine);
+    bool found = false;
+    for (std::size_t i = 0; i < command_line.size(); ++i) {
+      const std::string& arg(command_line[i]);
+      if (arg == "-c" || arg == "-MD" || arg == "-MMD")
+        continue;
+      if (arg == "-o" || arg == "-MF" || arg == "-MT" || arg == "-MQ") {
+        ++i;
+        continue;
+      }
+      if (i > 0 && ! arg.empty() && arg[0] != '-' &&
+          canonical_path(arg[0] == '/' ? arg :
+                         command.Directory + "/" + arg) == path) {
+        if (found)
+          return false;
+        found = true;
+        continue;
+      }
+      flags.push_back(arg);
+    }
+    return found && ! flags.empty();
+  }
+
+  // Write the first LENGTH directives of CANDIDATE to a header and
+  // precompile it with CANDIDATE's flags, adding it to PREAMBLES if that
+  // succeeds.
+  bool build_preamble(const Candidate& candidate, std::size_t length)
+  {
+    std::ostringstream name;
+    name << directory << "/preamble-" << preambles.size() << ".h";
+
+    Preamble preamble;
+    preamble.header       = name.str();
+    preamble.pch          = preamble.header + ".pch";
+    preamble.directory    = candidate.build_directory;
+    preamble.command_line = candidate.flags;
+    if (has_quoted(candidate, length)) {
+      preamble.command_line.push_back("-iquote");
+      preamble.command_line.push_back(candidate.directory);
+    }
+    preamble.command_line.push_back("-x");
+    preamble.command_line.push_back(candidate.language);
+    preamble.command_line.push_back(preamble.header);
+
+    std::FILE * file = std::fopen(preamble.header.c_str(), "w");
+    if (! file)
+      return false;
+    for (std::size_t i = 0; i < length; ++i)
+      std::fprintf(file, "%s\n", candidate.includes[i].c_str());
+    if (std::fclose(file) != 0)
+      return false;
+
+    preambles.push_back(preamble);
+    headers[canonical_path(preamble.header)] = preambles.size() - 1;
+
+    TagsPreambleActionFactory Factory(preamble.pch);
+    ClangTool Tool(*this, std::vector<std::string>(1, preamble.header));
+    struct stat st;
+    if (Tool.run(&Factory) == 0 && stat(preamble.pch.c_str(), &st) == 0)
+      return true;
+
+    std::cerr << "Could not precompile " << preamble.header
+              << "; its sources will be parsed in full" << std::endl;
+    headers.erase(canonical_path(preamble.header));
+    unlink(preamble.header.c_str());
+    unlink(preamble.pch.c_str());
+    preambles.pop_back();
+    return false;
+  }
+};
+
+class TagsClassAction : public ASTFrontendAction
+{
+  TagsClassVisitor              visitor;
+  IndexStatistics *             statistics;
+  PreambleCompilationDatabase * preambles;
+  IndexTier                     tier;
+  TagsTraversalGate *           gate;
+  std::string                   preamble_source;
+  bool                          parsed;
+
+public:
+  TagsClassAction(TagsDeclSink& db, IndexedFileSet * indexed_files,
+                  IndexStatistics * statistics,
+                  PreambleCompilationDatabase * preambles, IndexTier tier,
+                  TagsTraversalGate * gate)
+    : visitor(db, indexed_files, tier, statistics != NULL),
+      statistics(statistics), preambles(preambles), tier(tier), gate(gate),
+      parsed(false) {}
+
+  // If the source was given a preamble and never got as far as being
+  // parsed, the preamble could not be loaded.
+  virtual ~TagsClassAction() {
+    if (! preamble_source.empty() && ! parsed)
+      preambles->preamble_failed(preamble_source);
+  }
+
+  virtual ASTConsumer *CreateASTConsumer(CompilerInstance&,
+                                         llvm::StringRef InFile) {
+    return new TagsClassConsumer(visitor, statistics, InFile, gate);
+  }
+
+protected:
+  virtual bool BeginSourceFileAction(CompilerInstance& CI,
+                                     llvm::StringRef Filename) {
+    if (preambles) {
+      unsigned bytes = preambles->preamble_bytes(
+        Filename.str(), CI.getPreprocessorOpts().ImplicitPCHInclude,
+        preamble_source);
+      if (bytes)
+        CI.getPreprocessor().setSkipMainFilePreamble(bytes, true);
+      else
+        preamble_source.clear();
+    }
+    // Nothing inside a function body is indexed at the declarations tier,
+    // so the bodies need not even be parsed.
+    if (tier == TierDeclarations)
+      CI.getFrontendOpts().SkipFunctionBodies = true;
+    CI.getPreprocessor().addPPCallbacks(
+      new TagsMacroCallbacks(CI.getPreprocessor(), visitor));
+    return ASTFrontendAction::BeginSourceFileAction(CI, Filename);
+  }
+
+  virtual void ExecuteAction() {
+    parsed = true;
+    ASTFrontendAction::ExecuteAction();
+  }
+};
+
+// Runs only the preprocessor over a translation unit, indexing its macros
+// and the files it includes without the cost of parsing it.
+class TagsMacroAction : public PreprocessOnlyAction
+{
+  TagsClassVisitor    visitor;
+  IndexStatistics *   statistics;
+  TagsTraversalGate * gate;
+
+public:
+  TagsMacroAction(TagsDeclSink& db, IndexedFileSet * indexed_files,
+                  IndexStatistics * statistics, TagsTraversalGate * gate)
+    : visitor(db, indexed_files, TierMacros, statistics != NULL),
+      statistics(statistics), gate(gate) {}
+
+protected:
+  virtual bool BeginSourceFileAction(CompilerInstance& CI,
+                                     llvm::StringRef Filename) {
+    CI.getPreprocessor().addPPCallbacks(
+      new TagsMacroCallbacks(CI.getPreprocessor(), visitor));
+    return PreprocessOnlyAction::BeginSourceFileAction(CI, Filename);
+  }
+
+  virtual void ExecuteAction() {
+    double start = current_time();
+    PreprocessOnlyAction::ExecuteAction();
+    double preprocessed = current_time();
+    if (gate)
+      gate->wait();
+
+    SourceManager& SM(getCompilerInstance().getSourceManager());
+    visitor.store_macros(SM);
+    visitor.finish_translation_unit(SM);
+
+    if (statistics) {
+      IndexStatistics::UnitTiming timing;
+      timing.source           = getCurrentFile();
+      timing.parse_seconds    = preprocessed - start;
+      timing.traverse_seconds = 0;
+      timing.store_seconds    = visitor.store_seconds;
+      timing.records          = visitor.records_stored;
+      statistics->add_unit(timing);
+    }
+  }
+};
+
+class TagsClassActionFactory : public FrontendActionFactory
+{
+  TagsDeclSink&                 db;
+  IndexedFileSet *              indexed_files;
+  IndexStatistics *             statistics;
+  PreambleCompilationDatabase * preambles;
+  IndexTier                     tier;
+  TagsTraversalGate *           gate;
+public:
+  explicit TagsClassActionFactory(
+    TagsDeclSink& db, IndexedFileSet * indexed_files = NULL,
+    IndexStatistics * statistics = NULL,
+    PreambleCompilationDatabase * preambles = NULL,
+    IndexTier tier = TierFull, TagsTraversalGate * gate = NULL)
+    : db(db), indexed_files(indexed_files), statistics(statistics),
+      preambles(preambles), tier(tier), gate(gate) {}
+
+  virtual FrontendAction *create() {
+    if (tier == TierMacros)
+      return new TagsMacroAction(db, indexed_files, statistics, gate);
+    return new TagsClassAction(db, indexed_files, statistics, preambles,
+                               tier, gate);
+  }
+};
+
+// Index SOURCE with one ClangTool run, running it again without its
+// precompiled preamble if that could not be used.
+int index_source(const CompilationDatabase& Compilations,
+                 const std::string& Source, FrontendActionFactory& Factory,
+                 PreambleCompilationDatabase * Preambles)
+{
+  int result;
+  {
+    ClangTool Tool(Compilations, std::vector<std::string>(1, Source));
+    result = Tool.run(&Factory);
+  }
+  if (Preambles && Preambles->take_fallback(Source)) {
+    std::cerr << "Parsing " << Source << " without its preamble"
+              << std::endl;
+    ClangTool Tool(Compilations, std::vector<std::string>(1, Source));
+    result = Tool.run(&Factory);
+  }
+  return result;
+}
+
+// The directory the compile commands of SOURCE run in, or an empty string
+// when they do not all run in the same one.
+std::string command_directory(const CompilationDatabase& Compilations,
+                              const std::string& Source)
+{
+  std::vector<CompileCommand> Commands(Compilations.getCompileCommands(Source));
+  std::string directory;
+  for (std::vector<CompileCommand>::const_iterator i = Commands.begin();
+       i != Commands.end();
+       ++i) {
+    if (i == Commands.begin())
+      directory = (*i).Directory;
+    else if ((*i).Directory != directory)
+      return std::string();
+  }
+  return directory;
+}
+
+// Collects the declarations of one translation unit in memory, so that a
+// worker thread can index it without touching the database.  Line text is
+// copied into an arena owned by the buffer; paths already outlive it.
+class TagsDeclBuffer : public TagsDeclSink
+{
+  llvm::BumpPtrAllocator text_arena;
+
+public:
+  std::vector<TagsDeclRecord>            records;
+  std::vector<TagsTranslationUnitRecord> units;
+
+  // Handles are positions in RECORDS counting from one, which the merge
+  // maps to the handles of the real sink.
+  virtual long add_declaration(const TagsDeclRecord& record) {
+    records.push_back(record);
+
+    llvm::StringRef& line_text(records.back().line_text);
+    char * text = text_arena.Allocate<char>(line_text.size());
+    std::memcpy(text, line_text.data(), line_text.size());
+    line_text = llvm::StringRef(text, line_text.size());
+    return static_cast<long>(records.size());
+  }
+  virtual void add_translation_unit(const TagsTranslationUnitRecord& record) {
+    units.push_back(record);
+  }
+};
+
+// Indexes translation units on a pool of worker threads.  Each worker runs
+// its own ClangTool over one source at a time, buffering what it finds; the
+// calling thread then replays the buffers into the output strictly in
+// source order, so the IDs assigned are the same no matter how many workers
+// ran.  Workers are kept at most a few sources ahead of the merge to bound
+// the memory held in buffers.
+//
+// With header dedup, a header belongs to the first translation unit to
+// include it.  Workers still parse side by side, but each waits to
+// traverse its AST until every earlier source has been merged, so that
+// the headers are claimed in source order as in a serial run.
+//
+// ClangTool changes the process's working directory to that of each
+// compile command, so workers only run side by side while their commands
+// share a directory.  A source waits for those before it to start, and
+// then for the ones running in another directory to finish; a CMake build,
+// whose sources are grouped by target directory, still runs mostly in
+// parallel.  Since sources start in order, one holding a directory never
+// waits at the merge for a source that is waiting for that directory.
+class ParallelIndexer
+{
+  const CompilationDatabase&      Compilations;
+  const std::vector<std::string>& Sources;
+  TagsDeclSink&                   Output;
+  IndexedFileSet *                IndexedFiles;
+  IndexStatistics *               Statistics;
+  PreambleCompilationDatabase *   Preambles;
+  IndexTier                       Tier;
+  std::vector<std::string>        Directories;
+
+  pthread_mutex_t               Lock;
+  pthread_cond_t                Changed;
+  std::size_t                   NextSource;
+  std::size_t                   Merged;
+  std::size_t                   MaxAhead;
+  std::vector<TagsDeclBuffer *> Results;
+  int                           Status;
+  std::size_t                   Started;
+  std::size_t                   Running;
+  std::string                   Directory;
+
+public:
+  ParallelIndexer(const CompilationDatabase& Compilations,
+                  const std::vector<std::string>& Sources,
+                  TagsDeclSink& Output, IndexedFileSet * IndexedFiles,
+                  IndexStatistics * Statistics,
+                  PreambleCompilationDatabase * Preambles, IndexTier Tier)
+    : Compilations(Compilations), Sources(Sources), Output(Output),
+      IndexedFiles(IndexedFiles), Statistics(Statistics),
+      Preambles(Preambles), Tier(Tier),
+      NextSource(0), Merged(0), MaxAhead(0),
+      Results(Sources.size(), static_cast<TagsDeclBuffer *>(NULL)),
+      Status(0), Started(0), Running(0)
+  {
+    Directories.reserve(Sources.size());
+    for (std::vector<std::string>::const_iterator i = Sources.begin();
+         i != Sources.end();
+         ++i)
+      Directories.push_back(command_directory(Compilations, *i));
+
+    pthread_mutex_init(&Lock, NULL);
+    pthread_cond_init(&Changed, NULL);
+  }
+
+  ~ParallelIndexer() {
+    pthread_cond_destroy(&Changed);
+    pthread_mutex_destroy(&Lock);
+  }
+
+  int run(unsigned Jobs)
+  {
+    MaxAhead = 4 * Jobs;
+
+    // LLVM's lazily created globals are only guarded once this is called.
+    llvm::llvm_start_multithreaded();
+
+    std::vector<pthread_t> workers(Jobs);
+    for (unsigned i = 0; i < Jobs; ++i)
+      if (pthread_create(&workers[i], NULL, worker_main, this) != 0)
+        llvm::report_fatal_error("Could not start indexing thread");
+
+    for (std::size_t i = 0; i < Sources.size(); ++i) {
+      pthread_mutex_lock(&Lock);
+      while (! Results[i])
+        pthread_cond_wait(&Changed, &Lock);
+      TagsDeclBuffer * buffer = Results[i];
+      Results[i] = NULL;
+      pthread_mutex_unlock(&Lock);
+
+      double start = current_time();
+
+      // A record's context always precedes it in the buffer.
+      std::vector<long> handles(buffer->records.size() + 1, 0);
+      for (std::size_t j = 0; j < buffer->records.size(); ++j) {
+        TagsDeclRecord& record(buffer->records[j]);
+        record.context_ref = handles[record.context_ref];
+        handles[j + 1] = Output.add_declaration(record);
+      }
+      for (std::vector<TagsTranslationUnitRecord>::const_iterator j =
+             buffer->units.begin();
+           j != buffer->units.end();
+           ++j)
+        Output.add_translation_unit(*j);
+      delete buffer;
+
+      if (Statistics)
+        Statistics->add_merge(current_time() - start);
+
+      pthread_mutex_lock(&Lock);
+      Merged = i + 1;
+      pthread_cond_broadcast(&Changed);
+      pthread_mutex_unlock(&Lock);
+    }
+
+    for (unsigned i = 0; i < Jobs; ++i)
+      pthread_join(workers[i], NULL);
+
+    return Status;
+  }
+
+private:
+  // Holds a worker's translation unit back until the sources before it
+  // have all been merged.
+  class MergeGate : public TagsTraversalGate
+  {
+    ParallelIndexer& Indexer;
+    std::size_t      Index;
+
+  public:
+    MergeGate(ParallelIndexer& Indexer, std::size_t Index)
+      : Indexer(Indexer), Index(Index) {}
+
+    virtual void wait() {
+      pthread_mutex_lock(&Indexer.Lock);
+      while (Indexer.Merged < Index)
+        pthread_cond_wait(&Indexer.Changed, &Indexer.Lock);
+      pthread_mutex_unlock(&Indexer.Lock);
+    }
+  };
+
+  // Wait until the source at INDEX may run its compile commands: every
+  // source before it has started, and any still running share its
+  // directory.  A source whose commands disagree on one runs alone.
+  void enter_directory(std::size_t index)
+  {
+    const std::string& directory(Directories[index]);
+    pthread_mutex_lock(&Lock);
+    while (Started < index ||
+           (Running > 0 && (directory.empty() || directory != Directory)))
+      pthread_cond_wait(&Changed, &Lock);
+    Directory = directory;
+    ++Started;
+    ++Running;
+    pthread_cond_broadcast(&Changed);
+    pthread_mutex_unlock(&Lock);
+  }
+
+  void leave_directory()
+  {
+    pthread_mutex_lock(&Lock);
+    --Running;
+    pthread_cond_broadcast(&Changed);
+    pthread_mutex_unlock(&Lock);
+  }
+
+  static void * worker_main(void * indexer) {
+    static_cast<ParallelIndexer *>(indexer)->work();
+    return NULL;
+  }
+
+  void work()
+  {
+    for (;;) {
+      pthread_mutex_lock(&Lock);
+      while (NextSource < Sources.size() && NextSource >= Merged + MaxAhead)
+        pthread_cond_wait(&Changed, &Lock);
+      std::size_t index = NextSource++;
+      pthread_mutex_unlock(&Lock);
+
+      if (index >= Sources.size())
+        break;
+
+      TagsDeclBuffer * buffer = new TagsDeclBuffer;
+      MergeGate gate(*this, index);
+      TagsClassActionFactory Factory(*buffer, IndexedFiles, Statistics,
+                                     Preambles, Tier,
+                                     IndexedFiles ? &gate : NULL);
+      enter_directory(index);
+      int result = index_source(Compilations, Sources[index], Factory,
+                                Preambles);
+      leave_directory();
+
+      pthread_mutex_lock(&Lock);
+      if (result != 0)
+        Status = result;
+      Results[index] = buffer;
+      pthread_cond_broadcast(&Changed);
+      pthread_mutex_unlock(&Lock);
+    }
+  }
+};
+
+// A bounded queue between one producer thread and one consumer thread.
+// Each side owns one of the two positions and only reads the other's, so
+// neither takes a lock while the queue is neither full nor empty.  A side
+// publishes its position with a release store once it is done with a
+// slot, and reads the other's with an acquire load before touching one,
+// so a slot's contents are always seen whole.  A side that has to wait
+// sleeps on a condition variable, which the other only signals while
+// someone is waiting.  Slots are filled and read in place, so their
+// storage is reused rather than copied.
+template <typename T>
+class SpscQueue
+{
+  std::vector<T>  Slots;
+  std::size_t     Head;         // the next slot to read; the consumer's
+  std::size_t     Tail;         // the next slot to fill; the producer's
+  int             Waiting;
+  pthread_mutex_t Lock;
+  pthread_cond_t  Changed;
+
+public:
+  explicit SpscQueue(std::size_t capacity)
+    : Slots(capacity + 1), Head(0), Tail(0), Waiting(0)
+  {
+    pthread_mutex_init(&Lock, NULL);
+    pthread_cond_init(&Changed, NULL);
+  }
+
+  ~SpscQueue() {
+    pthread_cond_destroy(&Changed);
+    pthread_mutex_destroy(&Lock);
+  }
+
+  // The slot to fill next, once there is room for it.
+  T& back() {
+    while (full())
+      wait(true);
+    return Slots[__atomic_load_n(&Tail, __ATOMIC_RELAXED)];
+  }
+
+  // Hand the slot returned by back() to the consumer.
+  void push() {
+    std::size_t tail = __atomic_load_n(&Tail, __ATOMIC_RELAXED);
+    __atomic_store_n(&Tail, next(tail), __ATOMIC_RELEASE);
+    wake();
+  }
+
+  // The slot to read next, once there is one.
+  T& front() {
+    while (empty())
+      wait(false);
+    return Slots[__atomic_load_n(&Head, __ATOMIC_RELAXED)];
+  }
+
+  // Give the slot returned by front() back to the producer.
+  void pop() {
+    std::size_t head = __atomic_load_n(&Head, __ATOMIC_RELAXED);
+    __atomic_store_n(&Head, next(head), __ATOMIC_RELEASE);
+    wake();
+  }
+
+private:
+  std::size_t next(std::size_t position) const {
+    return position + 1 == Slots.size() ? 0 : position + 1;
+  }
+
+  bool full() const {
+    return (next(__atomic_load_n(&Tail, __ATOMIC_ACQUIRE)) ==
+            __atomic_load_n(&Head, __ATOMIC_ACQUIRE));
+  }
+  bool empty() const {
+    return (__atomic_load_n(&Head, __ATOMIC_ACQUIRE) ==
+            __atomic_load_n(&Tail, __ATOMIC_ACQUIRE));
+  }
+
+  // Sleep until the queue is not full, for the producer, or not empty, for
+  // the consumer.
+  //
+  // No wakeup can be missed.  The waiter raises WAITING and then looks at
+  // the queue again; the other side moves its position and then looks at
+  // WAITING.  A full fence sits between the store and the load on both
+  // sides, so at least one of them sees the other's store.  Either the
+  // waiter sees the new position and does not sleep, or the other side
+  // sees WAITING and broadcasts.  It can only broadcast once it holds LOCK,
+  // which the waiter keeps from its last look at the queue until
+  // pthread_cond_wait releases it, so the broadcast cannot fall in between.
+  void wait(bool producer)
+  {
+    pthread_mutex_lock(&Lock);
+    __atomic_add_fetch(&Waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (producer ? full() : empty())
+      pthread_cond_wait(&Changed, &Lock);
+    __atomic_sub_fetch(&Waiting, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&Lock);
+  }
+
+  void wake()
+  {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&Waiting, __ATOMIC_RELAXED)) {
+      pthread_mutex_lock(&Lock);
+      pthread_cond_broadcast(&Changed);
+      pthread_mutex_unlock(&Lock);
+    }
+  }
+};
+
+// Stores the indexer's records into OUTPUT on a thread of its own, so
+// that parsing and traversing a translation unit overlaps with storing the
+// records of the one before.  At most CAPACITY records are queued; beyond
+// that the indexer waits for the writer to catch up.  As with
+// TagsDeclBuffer, handles count the records of each translation unit from
+// one, and the writer maps them to OUTPUT's.
+class TagsWriterThread : public TagsDeclSink
+{
+  enum SlotKind { DeclarationSlot, UnitSlot, StopSlot };
+
+  struct Slot
+  {
+    SlotKind                  kind;
+    TagsDeclRecord            record;
+    std::string               line_text;  // what RECORD's line_text points to
+    TagsTranslationUnitRecord unit;
+  };
+
+  TagsDeclSink&     Output;
+  SpscQueue<Slot>   Queue;
+  pthread_t         Writer;
+  bool              Running;
+
+  long              Queued;     // records queued since the last unit
+  std::vector<long> Handles;    // OUTPUT's handles for those stored since
+  std::string       Error;
+
+public:
+  TagsWriterThread(TagsDeclSink& Output, std::size_t capacity)
+    : Output(Output), Queue(capacity), Running(false), Queued(0),
+      Handles(1, 0)
+  {
+    if (pthread_create(&Writer, NULL, writer_main, this) != 0)
+      llvm::report_fatal_error("Could not start database writer thread");
+    Running = true;
+  }
+
+  ~TagsWriterThread() {
+    stop();
+  }
+
+  virtual long add_declaration(const TagsDeclRecord& record)
   {
-    char * error_msg;
+    Slot& slot(Queue.back());
+    slot.kind   = DeclarationSlot;
+    slot.record = record;
+    slot.line_text.assign(record.line_text.data(), record.line_text.size());
+    slot.record.line_text = slot.line_text;
+    Queue.push();
+    return ++Queued;
+  }
+
+  virtual void add_translation_unit(const TagsTranslationUnitRecord& record)
+  {
+    Slot& slot(Queue.back());
+    slot.kind = UnitSlot;
+    slot.unit = record;
+    Queue.push();
+    Queued = 0;
+  }
+
+  // Wait for every record queued to be stored, reporting the first error
+  // the writer met.
+  void finish()
+  {
+    stop();
+    if (! Error.empty()) {
 #ifdef HAVE_EXCEPTIONS
-    try {
+      throw std::runtime_error(Error);
+#else
+      llvm::report_fatal_error(Error);
 #endif
-      sql_chk(sqlite3_exec(database, sql, NULL, NULL, &error_msg));
-      return static_cast<long>(sqlite3_last_insert_rowid(database));
-#ifdef HAVE_EXCEPTIONS
-    }
-    catch (const std::exception& err) {
-      std::cerr << "SQLite3 error: " << error_msg << std::endl;
-      std::cerr << "Error occurred with the following statement: "
-                << std::endl << sql << std::endl;
-      throw;
     }
-#endif
   }
 
-  long sqlite3_insert_maybe(
-    const char * select_sql, const char * insert_sql, ...)
+private:
+  void stop()
   {
-#ifdef USE_SQLITE3
-    va_list argslist;
-    va_start(argslist, insert_sql);
+    if (! Running)
+      return;
+    Queue.back().kind = StopSlot;
+    Queue.push();
+    pthread_join(Writer, NULL);
+    Running = false;
+  }
 
-    char *sql = sqlite3_vmprintf(select_sql, argslist);
-    long id = sqlite3_query_for_id(sql);
-    sqlite3_free(sql);
-    if (id == -1) {
-      va_start(argslist, insert_sql);
-      sql = sqlite3_vmprintf(insert_sql, argslist);
-      id = sqlite3_insert_new(sql);
-      sqlite3_free(sql);
-    }
+  static void * writer_main(void * writer) {
+    static_cast<TagsWriterThread *>(writer)->write();
+    return NULL;
+  }
+
+  // After an error the remaining records are still taken from the queue,
+  // so that the indexer never waits for good, but no longer stored.
+  void write()
+  {
+    for (;;) {
+      Slot& slot(Queue.front());
+      if (slot.kind == StopSlot) {
+        Queue.pop();
+        return;
+      }
+      if (Error.empty()) {
+#ifdef HAVE_EXCEPTIONS
+        try {
+          store(slot);
+        }
+        catch (const std::exception& error) {
+          Error = error.what();
+        }
 #else
-    long id =1;
+        store(slot);
 #endif
-    return id;
+      }
+      Queue.pop();
+    }
   }
 
-  virtual void add_declaration(NamedDecl *Declaration)
+  void store(Slot& slot)
   {
-    if (Declaration->getNameAsString().empty())
+    if (slot.kind == UnitSlot) {
+      Output.add_translation_unit(slot.unit);
+      Handles.assign(1, 0);
       return;
+    }
+    TagsDeclRecord& record(slot.record);
+    record.context_ref = Handles[record.context_ref];
+    Handles.push_back(Output.add_declaration(record));
+  }
+};
 
-    ASTContext& Context(Declaration->getASTContext());
+void print_tags(const std::vector<TagsDeclInfo>& tags, std::ostream& out)
+{
+  for (std::vector<TagsDeclInfo>::const_iterator i = tags.begin();
+       i != tags.end();
+       ++i)
+    out << (*i).filename << ":"
+        << (*i).line_no << ":" << (*i).col_no << ":" << (*i).text
+        << "\n";
+}
 
-    int decl_kind_id  = 1;
-    int is_implicit   = 0;
-    int is_definition = 0;
+// Answer one query against TAGS_DB, writing its results to OUT in the
+// format the command line prints.  Returns false if COMMAND is not a query.
+bool answer_query(TagsDatabase& tags_db, const std::string& command,
+                  const std::string& argument, std::ostream& out)
+{
+  if (command == "decl") {
+    print_tags(tags_db.find_declaration(argument), out);
+    return true;
+  }
+  if (command == "refs") {
+    print_tags(tags_db.find_references(argument), out);
+    return true;
+  }
+  if (command == "members") {
+    print_tags(tags_db.find_members(argument), out);
+    return true;
+  }
+  if (command == "at") {
+    // "FILE:LINE:COL"; the file name may itself contain colons.
+    std::string::size_type col_colon  = argument.rfind(':');
+    std::string::size_type line_colon =
+      col_colon == std::string::npos || col_colon == 0 ?
+      std::string::npos : argument.rfind(':', col_colon - 1);
+    if (line_colon == std::string::npos) {
+      out << "error: expected FILE:LINE:COL\n";
+      return true;
+    }
 
-    if (isa<FunctionDecl>(Declaration)) {
-      if (isa<CXXConstructorDecl>(Declaration)) {
-        CXXConstructorDecl * ctorDecl = cast<CXXConstructorDecl>(Declaration);
-        decl_kind_id  = 1;
-        is_definition = ctorDecl->isThisDeclarationADefinition();
-        is_implicit   = is_definition && ctorDecl->isImplicitlyDefined();
-      }
-      else if (isa<CXXDestructorDecl>(Declaration)) {
-        CXXDestructorDecl * dtorDecl = cast<CXXDestructorDecl>(Declaration);
-        decl_kind_id  = 1;
-        is_definition = dtorDecl->isThisDeclarationADefinition();
-        is_implicit   = is_definition && dtorDecl->isImplicitlyDefined();
-      }
-      else {
-        FunctionDecl * functionDecl = cast<FunctionDecl>(Declaration);
-        decl_kind_id  = 1;
-        is_definition = functionDecl->isThisDeclarationADefinition();
+    // Files are stored by their canonical paths.
+    print_tags(tags_db.find_at(
+                 canonical_path(argument.substr(0, line_colon)),
+                 std::atoi(argument.c_str() + line_colon + 1),
+                 std::atoi(argument.c_str() + col_colon + 1)), out);
+    return true;
+  }
+  if (command == "complete") {
+    // "PREFIX [COUNT]": one line per symbol, "SHORT\tFULL\tKINDS".
+    std::string::size_type space = argument.find(' ');
+    unsigned limit = 20;
+    if (space != std::string::npos)
+      limit = std::strtoul(argument.c_str() + space + 1, NULL, 10);
+
+    std::vector<TagsCompletion> completions(
+      tags_db.complete(argument.substr(0, space), limit));
+    for (std::vector<TagsCompletion>::const_iterator i = completions.begin();
+         i != completions.end();
+         ++i)
+      out << (*i).short_name << "\t" << (*i).full_name << "\t"
+          << (*i).kinds << "\n";
+    return true;
+  }
+  return false;
+}
+
+// Answer COMMAND, "decl" or "refs", for each name read from IN, one per
+// line, writing every result to OUT as a line tagged with the name it
+// answers: "NAME\tFILE\tLINE\tCOL\tTEXT" (the line's text last, since it
+// may itself contain tabs) or, with JSON, an object with those fields.
+// Each query reuses the database's prepared statement, and the output is
+// gathered in memory and written in large chunks.
+void answer_batch(TagsDatabase& tags_db, const std::string& command,
+                  bool json, std::istream& in, std::FILE * out)
+{
+  static const std::streampos chunk_size = 1 << 20;
+
+  std::ostringstream buffer;
+  std::string name;
+  while (std::getline(in, name)) {
+    if (! name.empty() && name[name.size() - 1] == '\r')
+      name.erase(name.size() - 1);
+    if (name.empty())
+      continue;
+
+    std::vector<TagsDeclInfo> tags(command == "decl"
+                                   ? tags_db.find_declaration(name)
+                                   : tags_db.find_references(name));
+    for (std::vector<TagsDeclInfo>::const_iterator i = tags.begin();
+         i != tags.end();
+         ++i) {
+      if (json) {
+        buffer << "{\"name\":";
+        write_json_string(buffer, name);
+        buffer << ",\"file\":";
+        write_json_string(buffer, (*i).filename);
+        buffer << ",\"line\":" << (*i).line_no
+               << ",\"col\":" << (*i).col_no << ",\"text\":";
+        write_json_string(buffer, (*i).text);
+        buffer << "}\n";
       }
+      else
+        buffer << name << "\t" << (*i).filename << "\t" << (*i).line_no
+               << "\t" << (*i).col_no << "\t" << (*i).text << "\n";
     }
-    else if (isa<TagDecl>(Declaration)) {
-      TagDecl * tagDecl = cast<TagDecl>(Declaration);
-      decl_kind_id  = 2;        // jww (2012-05-23): What about enums?
-      is_definition = tagDecl->isThisDeclarationADefinition();
-    }
-    else if (isa<VarDecl>(Declaration)) {
-      VarDecl * varDecl = cast<VarDecl>(Declaration);
-      decl_kind_id  = 3;
-      is_definition = varDecl->isThisDeclarationADefinition();
+
+    if (buffer.tellp() >= chunk_size) {
+      std::string chunk(buffer.str());
+      std::fwrite(chunk.data(), 1, chunk.size(), out);
+      buffer.str(std::string());
     }
+  }
 
-    FullSourceLoc FullLocation = Context.getFullLoc(Declaration->getLocStart());
-    if (!FullLocation.isValid())
-      return;
+  std::string chunk(buffer.str());
+  std::fwrite(chunk.data(), 1, chunk.size(), out);
+  std::fflush(out);
+}
 
-    std::pair<FileID, unsigned> LocInfo = FullLocation.getDecomposedLoc();
+// Set by SIGINT or SIGTERM in the commands that run until interrupted,
+// which then finish what they are doing and return.
+volatile sig_atomic_t Interrupted = 0;
 
-    FileID file_id = FullLocation.getFileID();
-    const FileEntry * file_entry =
-      FullLocation.getManager().getFileEntryForID(file_id);
-    if (!file_entry)
-      return;
+extern "C" void interrupt(int) {
+  Interrupted = 1;
+}
 
-    bool InvalidFile = false;
-    const llvm::MemoryBuffer * Buffer =
-      FullLocation.getManager().getBuffer(LocInfo.first, &InvalidFile);
-    if (InvalidFile || !Buffer)
-      return;
+// Serves queries from an open database over a Unix domain socket, so that
+// editors need not start a process and re-open the database per lookup.
+// Each request is one line, "COMMAND ARGUMENT"; the reply is the lines the
+// same command prints on the command line, followed by an empty line.
+// Unknown commands are answered with a line starting "error:".
+class TagsQueryServer
+{
+  TagsDatabase& tags_db;
+  std::string   socket_path;
+  int           listener;
 
-    std::size_t offset =
-      LocInfo.second - (FullLocation.getSpellingColumnNumber() - 1);
-    const char * BufferStart = Buffer->getBufferStart();
-    const char * BufferEnd = Buffer->getBufferEnd();
-    const char * LineBegin = BufferStart + offset;
-#ifdef HAVE_EXCEPTIONS
-    if (LineBegin >= BufferEnd)
-      throw std::runtime_error("Buffer invalid");
-#endif
-    const char * LineEnd = LineBegin;
-    while (*LineEnd && *LineEnd != '\n') {
-      ++LineEnd;
-#ifdef HAVE_EXCEPTIONS
-      if (LineEnd >= BufferEnd)
-        throw std::runtime_error("Buffer invalid");
-#endif
+  struct Client
+  {
+    int         fd;
+    std::string input;
+  };
+  std::vector<Client> clients;
+
+public:
+  TagsQueryServer(TagsDatabase& tags_db, const std::string& socket_path)
+    : tags_db(tags_db), socket_path(socket_path), listener(-1) {}
+
+  ~TagsQueryServer() {
+    for (std::vector<Client>::iterator i = clients.begin();
+         i != clients.end();
+         ++i)
+      close((*i).fd);
+    if (listener != -1) {
+      close(listener);
+      unlink(socket_path.c_str());
     }
-    std::string LineBuf(LineBegin, LineEnd);
+  }
 
-    long source_path_dirname_id =
-      sqlite3_insert_maybe(
-        "SELECT id FROM SourcePaths WHERE pathname = %Q",
-        "INSERT INTO SourcePaths (pathname) VALUES (%Q);",
-        file_entry->getDir()->getName());
+  int run()
+  {
+    struct sockaddr_un address;
+    if (socket_path.size() >= sizeof address.sun_path) {
+      std::cerr << "Socket path too long: " << socket_path << std::endl;
+      return 1;
+    }
+    std::memset(&address, 0, sizeof address);
+    address.sun_family = AF_UNIX;
+    std::strcpy(address.sun_path, socket_path.c_str());
 
-    long source_path_id =
-      sqlite3_insert_maybe(
-        "SELECT id FROM SourcePaths WHERE dirname_id = %d AND pathname = %Q",
-        "INSERT INTO SourcePaths (dirname_id, pathname) VALUES (%d, %Q);",
-        source_path_dirname_id, file_entry->getName());
-
-    SourceLine source_line(
-      source_path_id, FullLocation.getSpellingLineNumber());
-    std::map<SourceLine, int>::iterator source_line_i =
-      source_lines_map.find(source_line);
-
-    long source_line_id;
-    if (source_line_i == source_lines_map.end()) {
-      source_line_id =
-        sqlite3_insert_maybe(
-          "SELECT id FROM SourceLines \
-             WHERE source_path_id = %d AND lineno = %d",
-          "INSERT INTO SourceLines (source_path_id, lineno, text) \
-             VALUES (%d, %d, %Q);",
-          source_line.source_path_id, source_line.lineno, LineBuf.c_str());
-
-      source_lines_map.insert(std::make_pair(source_line, source_line_id));
-    } else {
-      source_line_id = (*source_line_i).second;
-    }
-
-    SymbolName symbol_name(
-      Declaration->getNameAsString().c_str(),
-      Declaration->getQualifiedNameAsString().c_str());
-    std::map<SymbolName, int>::iterator symbol_name_i =
-      symbol_names_map.find(symbol_name);
-
-    long symbol_name_id;
-    if (symbol_name_i == symbol_names_map.end()) {
-      symbol_name_id =
-        sqlite3_insert_maybe(
-          "SELECT id FROM SymbolNames \
-             WHERE short_name = %Q AND full_name = %Q",
-          "INSERT INTO SymbolNames (short_name, full_name) \
-             VALUES (%Q, %Q);",
-          symbol_name.short_name.c_str(), symbol_name.full_name.c_str());
-
-      symbol_names_map.insert(std::make_pair(symbol_name, symbol_name_id));
-    } else {
-      symbol_name_id = (*symbol_name_i).second;
+    unlink(socket_path.c_str());
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener == -1 ||
+        bind(listener, reinterpret_cast<struct sockaddr *>(&address),
+             sizeof address) != 0 ||
+        listen(listener, 64) != 0) {
+      std::cerr << "Cannot listen on " << socket_path << ": "
+                << std::strerror(errno) << std::endl;
+      return 1;
     }
 
-    TDeclaration tdeclaration(
-      symbol_name_id, decl_kind_id, is_definition, is_implicit);
-    std::map<TDeclaration, int>::iterator tdeclaration_i =
-      tdeclarations_map.find(tdeclaration);
-
-    long tdeclaration_id;
-    if (tdeclaration_i == tdeclarations_map.end()) {
-      tdeclaration_id =
-        sqlite3_insert_maybe(
-          "SELECT id FROM Declarations \
-             WHERE symbol_name_id = %d AND kind_id = %d AND \
-                   is_definition = %d AND is_implicitly_defined = %d",
-          "INSERT INTO Declarations (symbol_name_id, kind_id, is_definition, \
-                                     is_implicitly_defined) \
-             VALUES (%d, %d, %d, %d);",
-          tdeclaration.symbol_name_id, tdeclaration.kind_id,
-          tdeclaration.is_definition, tdeclaration.is_implicitly_defined);
-
-      tdeclarations_map.insert(std::make_pair(tdeclaration, tdeclaration_id));
-    } else {
-      tdeclaration_id = (*tdeclaration_i).second;
-    }
-
-#ifdef USE_SQLITE3
-    char * sql = sqlite3_mprintf(
-      "INSERT OR IGNORE INTO DeclRefs ( \
-           declaration_id, ref_kind_id, source_line_id, colno, is_implicit) \
-           VALUES (%d, %d, %d, %d, %d);",
-      tdeclaration_id, is_definition ? 1 : 2, source_line_id,
-      FullLocation.getSpellingColumnNumber(),
-      tdeclaration.is_implicitly_defined);
-    pending_sql << sql;
-    sqlite3_free(sql);
-#endif
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, interrupt);
+    signal(SIGTERM, interrupt);
 
-    if (++DeclarationsCounted % 100 == 0)
-      std::cerr << DeclarationsCounted << " declarations counted\r";
+    std::cerr << "Serving queries on " << socket_path << std::endl;
+
+    std::vector<struct pollfd> fds;
+    while (! Interrupted) {
+      fds.clear();
+      struct pollfd listen_fd = { listener, POLLIN, 0 };
+      fds.push_back(listen_fd);
+      for (std::vector<Client>::const_iterator i = clients.begin();
+           i != clients.end();
+           ++i) {
+        struct pollfd client_fd = { (*i).fd, POLLIN, 0 };
+        fds.push_back(client_fd);
+      }
+
+      if (poll(&fds[0], fds.size(), -1) == -1) {
+        if (errno == EINTR)
+          continue;
+        std::cerr << "poll: " << std::strerror(errno) << std::endl;
+        return 1;
+      }
+
+      // Service clients before accepting, since accepting changes the
+      // indices that line up CLIENTS with FDS.
+      for (std::size_t i = clients.size(); i > 0; --i)
+        if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+          if (! read_requests(clients[i - 1])) {
+            close(clients[i - 1].fd);
+            clients.erase(clients.begin() + (i - 1));
+          }
+
+      if (fds[0].revents & POLLIN) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd != -1) {
+          Client client;
+          client.fd = fd;
+          clients.push_back(client);
+        }
+      }
+    }
+    return 0;
   }
 
-  virtual std::vector<TagsDeclInfo> find_declaration(const std::string& name)
+private:
+  // Read what CLIENT has sent and answer every complete request line.
+  // Returns false once the client has gone away.
+  bool read_requests(Client& client)
   {
-    char * sql = sqlite3_mprintf(
-      "\
-SELECT                                                  \
-    Declarations.id,                                    \
-    SourcePaths.dirname,                                \
-    SourcePaths.pathname,                               \
-    SourceLines.lineno,                                 \
-    DeclRefs.colno,                                     \
-    SourceLines.text                                    \
-FROM                                                    \
-    DeclRefs,                                           \
-    Declarations,                                       \
-    SourcePaths,                                        \
-    SourceLines                                         \
-WHERE                                                   \
-    DeclRefs.declaration_id     = Declarations.id       \
-AND DeclRefs.source_line_id     = SourceLines.id        \
-AND SourceLines.source_path_id  = SourcePaths.id        \
-AND Declarations.symbol_name_id =                       \
-    (                                                   \
-        SELECT                                          \
-            id                                          \
-        FROM                                            \
-            SymbolNames                                 \
-        WHERE                                           \
-            full_name = %Q);", name.c_str());
+    char buffer[4096];
+    ssize_t length = read(client.fd, buffer, sizeof buffer);
+    if (length <= 0)
+      return length < 0 && errno == EINTR;
+    client.input.append(buffer, length);
 
+    std::string::size_type newline;
+    while ((newline = client.input.find('\n')) != std::string::npos) {
+      std::string request(client.input, 0, newline);
+      client.input.erase(0, newline + 1);
+      if (! request.empty() && request[request.size() - 1] == '\r')
+        request.erase(request.size() - 1);
+
+      std::string::size_type space = request.find(' ');
+      std::string command(request, 0, space);
+      std::string argument;
+      if (space != std::string::npos)
+        argument.assign(request, space + 1, std::string::npos);
+
+      std::ostringstream reply;
 #ifdef HAVE_EXCEPTIONS
-    try {
+      try {
 #endif
-      sqlite3_stmt *stmt;
-      sql_chk(sqlite3_prepare(database, sql, std::strlen(sql), &stmt, NULL));
-
-      std::vector<TagsDeclInfo> tags;
-      while (sqlite3_step(stmt) == SQLITE_ROW) {
-        TagsDeclInfo info;
-        info.name     = name;
-        info.id       = sqlite3_column_int(stmt, 0);
-        info.filename =
-          (std::string(
-            reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1))) +
-           "/" + reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2)));
-        info.line_no  = sqlite3_column_int(stmt, 3);
-        info.col_no   = sqlite3_column_int(stmt, 4);
-        info.text     = (reinterpret_cast<const char *>(
-                           sqlite3_column_text(stmt, 5)));
-        tags.push_back(info);
-      }
-
-      sql_chk(sqlite3_finalize(stmt));
-      sqlite3_free(sql);
-      return tags;
+        if (! answer_query(tags_db, command, argument, reply))
+          reply << "error: unknown command " << command << "\n";
 #ifdef HAVE_EXCEPTIONS
-    }
-    catch (const std::exception& err) {
-      std::cerr << "Error occurred with the following query: "
-                << std::endl << sql << std::endl;
-      sqlite3_free(sql);
-      throw;
-    }
+      }
+      catch (const std::exception& err) {
+        reply << "error: " << err.what() << "\n";
+      }
 #endif
-  }
-};
-
-class TagsClassVisitor : public RecursiveASTVisitor<TagsClassVisitor>
-{
-  TagsDatabase& tags_db;
+      reply << "\n";
 
-public:
-  explicit TagsClassVisitor(TagsDatabase& db) : tags_db(db) {}
-  virtual ~TagsClassVisitor() {}
+      if (! write_all(client.fd, reply.str()))
+        return false;
+    }
+    return true;
+  }
 
-  bool VisitNamedDecl(NamedDecl *Declaration) {
-    tags_db.add_declaration(Declaration);
+  static bool write_all(int fd, const std::string& data)
+  {
+    const char * p   = data.data();
+    const char * end = p + data.size();
+    while (p != end) {
+      ssize_t written = write(fd, p, end - p);
+      if (written < 0) {
+        if (errno == EINTR)
+          continue;
+        return false;
+      }
+      p += written;
+    }
     return true;
   }
 };
 
-class TagsClassConsumer : public ASTConsumer
+// Watches directories with inotify and collects the paths of the files
+// written, moved or deleted in them.
+class SourceWatcher
 {
+  int                        fd;
+  std::map<int, std::string> directories;   // by watch descriptor
+
 public:
-  explicit TagsClassConsumer(TagsDatabase& db) : Visitor(db) {}
-  virtual ~TagsClassConsumer() {}
+  SourceWatcher() : fd(inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) {
+    if (fd == -1)
+      llvm::report_fatal_error(std::string("inotify: ") +
+                               std::strerror(errno));
+  }
+  ~SourceWatcher() {
+    close(fd);
+  }
 
-  virtual void HandleTranslationUnit(ASTContext& Context) {
-    Visitor.TraverseDecl(Context.getTranslationUnitDecl());
+  // Watch each directory of PATHS that is not watched already.  Those
+  // that no longer exist are skipped.
+  void watch(const std::vector<std::string>& paths)
+  {
+    for (std::vector<std::string>::const_iterator i = paths.begin();
+         i != paths.end();
+         ++i) {
+      int wd = inotify_add_watch(fd, (*i).c_str(),
+                                 IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE |
+                                 IN_DELETE | IN_MOVED_FROM);
+      if (wd != -1)
+        directories[wd] = *i;
+    }
   }
 
-private:
-  TagsClassVisitor Visitor;
-};
+  std::size_t size() const {
+    return directories.size();
+  }
 
-class TagsClassAction : public ASTFrontendAction
-{
-  TagsDatabase& db;
+  // Wait up to TIMEOUT milliseconds, or for good if it is negative, for
+  // changes, adding the paths changed to CHANGED.  Returns false if there
+  // were none.  OVERFLOWED is set if the kernel dropped some, in which
+  // case CHANGED is incomplete.
+  bool wait(int timeout, std::set<std::string>& changed, bool& overflowed)
+  {
+    struct pollfd watch_fd = { fd, POLLIN, 0 };
+    if (poll(&watch_fd, 1, timeout) <= 0)
+      return false;
 
-public:
-  TagsClassAction(TagsDatabase& db) : db(db) {}
-  virtual ~TagsClassAction() {}
+    char buffer[65536]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool found = false;
+    ssize_t length;
+    while ((length = read(fd, buffer, sizeof buffer)) > 0) {
+      for (char * p = buffer; p < buffer + length; ) {
+        const struct inotify_event * event =
+          reinterpret_cast<const struct inotify_event *>(p);
+        p += sizeof(struct inotify_event) + event->len;
+        found = true;
 
-  virtual ASTConsumer *CreateASTConsumer(CompilerInstance&, llvm::StringRef) {
-    return new TagsClassConsumer(db);
+        if (event->mask & IN_Q_OVERFLOW)
+          overflowed = true;
+        else if (event->mask & IN_IGNORED)
+          directories.erase(event->wd);
+        else if (event->len) {
+          std::map<int, std::string>::const_iterator i =
+            directories.find(event->wd);
+          if (i != directories.end())
+            changed.insert((*i).second + "/" + event->name);
+        }
+      }
+    }
+    return found;
   }
 };
 
-class TagsClassActionFactory : public FrontendActionFactory
-{
-  TagsDatabase& db;
-public:
-  explicit TagsClassActionFactory(TagsDatabase& db) : db(db) {}
-
-  virtual FrontendAction *create() { return new TagsClassAction(db); }
-};
-
 cl::opt<std::string> BuildPath(
   cl::Positional,
   cl::desc("<build-path>"));
@@ -705,38 +5444,441 @@ cl::opt<std::string> BuildPath(
 cl::list<std::string> SourcePaths(
   cl::Positional,
   cl::desc("<source0> [... <sourceN>]"),
-  cl::OneOrMore);
+  cl::ZeroOrMore);
+
+cl::opt<unsigned> Jobs(
+  "j",
+  cl::desc("Number of translation units to index in parallel; only those "
+           "whose compile commands share a directory run together"),
+  cl::init(1u));
+
+cl::opt<unsigned> QueueRecords(
+  "queue-records",
+  cl::desc("Records the indexer may get ahead of the thread storing them, "
+           "or 0 to store them on the indexing thread"),
+  cl::init(16384u));
+
+cl::opt<bool> DedupHeaders(
+  "dedup-headers",
+  cl::desc("Skip declarations in files already indexed, in this run or "
+           "an earlier one, with the same contents"));
+
+cl::opt<unsigned> BatchRows(
+  "batch-rows",
+  cl::desc("Commit a transaction after this many rows are written"),
+  cl::init(100000u));
+
+cl::opt<unsigned> BatchBytes(
+  "batch-bytes",
+  cl::desc("Commit a transaction after about this many bytes are written"),
+  cl::init(64u << 20));
+
+cl::opt<std::string> SocketPath(
+  "socket",
+  cl::desc("Unix domain socket on which 'serve' answers queries"),
+  cl::init(std::string("./CLTAGS.sock")));
+
+cl::opt<std::string> IndexPath(
+  "index",
+  cl::desc("Have 'serve' answer from this index written by 'export' "
+           "instead of CLTAGS"));
+
+cl::opt<bool> NoPreload(
+  "no-preload",
+  cl::desc("Do not load the existing database's IDs into memory before "
+           "indexing (slower, but uses less memory)"));
+
+cl::opt<bool> BulkLoad(
+  "bulk-load",
+  cl::desc("Drop the database's indexes while indexing and rebuild them "
+           "afterwards (not for 'update' or 'watch')"));
+
+cl::opt<bool> ReusePreamble(
+  "reuse-preamble",
+  cl::desc("Precompile the #include lines that translation units with the "
+           "same flags start with once, and reuse them for each"));
+
+cl::opt<std::string> OutputPath(
+  "output",
+  cl::desc("Database to index into, merge into or serve (default CLTAGS)"),
+  cl::init(std::string("./CLTAGS")));
+
+cl::opt<std::string> Shard(
+  "shard",
+  cl::desc("Index only shard I of N of the sources, given as I/N "
+           "counting from 0, for 'merge' to combine later"));
+
+cl::opt<int> WatchSettle(
+  "settle",
+  cl::desc("Milliseconds 'watch' waits for changes to stop before "
+           "re-indexing"),
+  cl::init(200));
+
+cl::opt<bool> Batch(
+  "batch",
+  cl::desc("Have 'decl' and 'refs' read names from stdin, one per line"));
+
+cl::opt<std::string> BatchFormat(
+  "format",
+  cl::desc("Output format of --batch: 'tsv' (the default) or 'json'"),
+  cl::init(std::string("tsv")));
+
+cl::opt<bool> Fast(
+  "fast",
+  cl::desc("Index only namespace- and class-scope declarations, skipping "
+           "function bodies; a later 'update' without it indexes the rest"));
+
+cl::opt<bool> MacrosOnly(
+  "macros-only",
+  cl::desc("Only preprocess, indexing nothing but macros; a later "
+           "'update' without it indexes the rest"));
+
+cl::opt<bool> Statistics(
+  "stats",
+  cl::desc("Report timings and counters as JSON on stderr when done"));
+
+cl::opt<unsigned> StatisticsInterval(
+  "stats-interval",
+  cl::desc("Also report them every this many seconds while indexing"),
+  cl::init(0u));
+
+// The tier --fast and --macros-only select.
+IndexTier selected_tier()
+{
+  return MacrosOnly ? TierMacros : Fast ? TierDeclarations : TierFull;
+}
+
+// The sources in the shard --shard names: after sorting, every Nth one
+// starting from the Ith, so that every job splits the same sources the
+// same way whatever order they are given in.
+std::vector<std::string> shard_sources(const std::vector<std::string>& all)
+{
+  char * end;
+  unsigned long index = std::strtoul(Shard.c_str(), &end, 10);
+  unsigned long count = 0;
+  if (end != Shard.c_str() && *end == '/')
+    count = std::strtoul(end + 1, &end, 10);
+  if (count == 0 || index >= count || *end)
+    llvm::report_fatal_error("--shard must be I/N with 0 <= I < N");
+
+  std::set<std::string> sorted(all.begin(), all.end());
+  std::vector<std::string> sources;
+  unsigned long position = 0;
+  for (std::set<std::string>::const_iterator i = sorted.begin();
+       i != sorted.end();
+       ++i, ++position)
+    if (position % count == index)
+      sources.push_back(*i);
+  return sources;
+}
+
+// The compilation database in <build-path>, found by its absolute path,
+// since running ClangTool changes the working directory.
+CompilationDatabase * load_compilations()
+{
+  std::string ErrorMessage;
+  CompilationDatabase * Compilations =
+    CompilationDatabase::loadFromDirectory(canonical_path(BuildPath),
+                                           ErrorMessage);
+  if (!Compilations)
+    llvm::report_fatal_error(ErrorMessage);
+  return Compilations;
+}
+
+// Index SOURCES into TAGS_DB.  INCREMENTAL is set for 'update' and
+// 'watch', whose deletions by prepare_update are still uncommitted.
+int index_sources(SqliteTagsDatabase& tags_db,
+                  const CompilationDatabase& Compilations,
+                  const std::vector<std::string>& Sources,
+                  IndexedFileSet * indexed_files, bool incremental)
+{
+  if (! NoPreload)
+    tags_db.preload_caches();
+
+  // Without the indexes every lookup would scan its table, so a bulk load
+  // needs caches that answer them all.  Dropping the indexes commits, so
+  // an incremental run never bulk loads: its deletions would become
+  // visible without the rows that replace them.  Otherwise make sure the
+  // indexes exist, in case an earlier bulk load was interrupted.
+  bool bulk_load = BulkLoad && tags_db.caches_complete() && ! incremental;
+  if (BulkLoad && incremental)
+    std::cerr << "--bulk-load ignored by 'update' and 'watch'" << std::endl;
+  else if (BulkLoad && ! bulk_load)
+    std::cerr << "--bulk-load ignored with --no-preload" << std::endl;
+  if (bulk_load)
+    tags_db.drop_indexes();
+  else
+    tags_db.create_indexes();
+
+  IndexStatistics   Stats;
+  IndexStatistics * statistics = NULL;
+  if (Statistics || StatisticsInterval) {
+    statistics = &Stats;
+    tags_db.set_statistics(statistics, StatisticsInterval);
+  }
+
+  // Preprocessing alone cannot load a precompiled preamble.
+  IndexTier tier = selected_tier();
+  if (ReusePreamble && tier == TierMacros)
+    std::cerr << "--reuse-preamble ignored with --macros-only" << std::endl;
+
+  llvm::OwningPtr<PreambleCompilationDatabase> Preambles;
+  if (ReusePreamble && tier != TierMacros) {
+    // Kept beside the database, so that runs writing different databases
+    // in one directory, such as shards, do not share them.
+    Preambles.reset(new PreambleCompilationDatabase(
+                      Compilations, OutputPath + ".preambles"));
+    std::size_t sharing = Preambles->build(Sources);
+    std::cerr << "Precompiled " << Preambles->preamble_count()
+              << " preambles for " << sharing << " of " << Sources.size()
+              << " translation units" << std::endl;
+  }
+  const CompilationDatabase& Commands(
+    Preambles ? *Preambles : Compilations);
+
+  llvm::OwningPtr<TagsWriterThread> Writer;
+  if (QueueRecords)
+    Writer.reset(new TagsWriterThread(tags_db, QueueRecords));
+  TagsDeclSink& Sink(Writer ? static_cast<TagsDeclSink&>(*Writer) : tags_db);
+
+  int result;
+  if (Jobs > 1) {
+    ParallelIndexer Indexer(Commands, Sources, Sink, indexed_files,
+                            statistics, Preambles.get(), tier);
+    result = Indexer.run(Jobs);
+  } else if (Preambles) {
+    // One run per source, so that each can fall back on its own.
+    TagsClassActionFactory Factory(Sink, indexed_files, statistics,
+                                   Preambles.get(), tier);
+    result = 0;
+    for (std::vector<std::string>::const_iterator i = Sources.begin();
+         i != Sources.end();
+         ++i)
+      if (index_source(Commands, *i, Factory, Preambles.get()) != 0)
+        result = 1;
+  } else {
+    // We hand the CompilationDatabase we created and the sources to run
+    // over into the tool constructor.
+    ClangTool Tool(Compilations, Sources);
+
+    // The ClangTool needs a new FrontendAction for each translation unit
+    // we run on. Thus, it takes a FrontendActionFactory as parameter.
+    result = Tool.run(new TagsClassActionFactory(Sink, indexed_files,
+                                                 statistics, NULL, tier));
+  }
+  if (Writer)
+    Writer->finish();
+  if (bulk_load) {
+    std::cerr << "Creating indexes" << std::endl;
+    tags_db.commit_batch();
+    tags_db.create_indexes();
+  }
+  if (Statistics)
+    tags_db.report_statistics(std::cerr);
+  tags_db.set_statistics(NULL, 0);
+  return result;
+}
+
+// Keep the database up to date until interrupted.  Whenever files in the
+// directories of those indexed change, wait for the changes to settle and
+// re-index the translation units affected, much as 'update' does.  Each
+// round is one transaction, so that readers of the database only ever see
+// it before or after the round.
+int watch_sources(SqliteTagsDatabase& tags_db)
+{
+  signal(SIGINT, interrupt);
+  signal(SIGTERM, interrupt);
+  tags_db.set_batch_limits(~0u, ~std::size_t(0));
+
+  // ClangTool leaves the process in the directory of the last command it
+  // ran, so the compilation database is loaded only once, and each round
+  // starts again from the directory the watch was started in.
+  llvm::OwningPtr<CompilationDatabase> Compilations(load_compilations());
+  std::string directory(canonical_path("."));
+
+  SourceWatcher         Watcher;
+  std::set<std::string> changed;
+  bool                  overflowed   = true;  // so every file is checked
+  double                first_change = 0;
+  int                   result       = 0;
+  while (! Interrupted) {
+    if (! changed.empty() || overflowed) {
+      IndexedFileSet Unchanged;
+      std::vector<std::string> Sources(
+        tags_db.prepare_update(Unchanged, selected_tier() == TierFull,
+                               overflowed ? NULL : &changed));
+      double start = current_time();
+      if (! Sources.empty() &&
+          index_sources(tags_db, *Compilations, Sources, &Unchanged,
+                        true) != 0)
+        result = 1;
+      if (chdir(directory.c_str()) != 0)
+        llvm::report_fatal_error("Could not return to " + directory);
+      tags_db.commit_batch();
+
+      // The latency reported runs from the first change seen to the
+      // commit that makes it visible.
+      if (! Sources.empty()) {
+        double finished = current_time();
+        std::cerr << "Re-indexed " << Sources.size()
+                  << " translation units in " << finished - start << " s";
+        if (first_change)
+          std::cerr << ", " << finished - first_change
+                    << " s after the first change";
+        std::cerr << std::endl;
+      }
+
+      Watcher.watch(tags_db.source_directories());
+      if (! Watcher.size()) {
+        std::cerr << "No indexed files to watch" << std::endl;
+        return 1;
+      }
+      changed.clear();
+      overflowed = false;
+      std::cerr << "Watching " << Watcher.size() << " directories"
+                << std::endl;
+    }
+
+    std::set<std::string> paths;
+    if (! Watcher.wait(-1, paths, overflowed))
+      continue;
+    first_change = current_time();
+
+    // Editors often write a file in several steps, and builds touch many
+    // files at once, so wait for a quiet spell before looking.
+    while (! Interrupted && Watcher.wait(WatchSettle, paths, overflowed))
+      ;
+    for (std::set<std::string>::const_iterator i = paths.begin();
+         i != paths.end();
+         ++i)
+      if (tags_db.is_source_file(*i))
+        changed.insert(*i);
+  }
+  return result;
+}
 
 int main(int argc, char **argv) {
   if (argc > 1) {
-    SqliteTagsDatabase tags_db("./CLTAGS");
-
-    if (std::string(argv[1]) == "decl") {
-      std::vector<TagsDeclInfo> tags(tags_db.find_declaration(argv[2]));
-      for (std::vector<TagsDeclInfo>::const_iterator i = tags.begin();
-           i != tags.end();
-           ++i)
-        std::cout << (*i).filename << ":"
-                  << (*i).line_no << ":" << (*i).col_no << ":" << (*i).text
-                  << std::endl;
-    } else {
-      cl::ParseCommandLineOptions(argc, argv);
-
-      std::string ErrorMessage;
-      llvm::OwningPtr<CompilationDatabase> Compilations(
-        CompilationDatabase::loadFromDirectory(BuildPath, ErrorMessage));
-      if (!Compilations)
-        llvm::report_fatal_error(ErrorMessage);
-
-      // We hand the CompilationDatabase we created and the sources to run over into
-      // the tool constructor.
-      ClangTool Tool(*Compilations, SourcePaths);
-
-      // The ClangTool needs a new FrontendAction for each translation unit we run
-      // on. Thus, it takes a FrontendActionFactory as parameter. To create a
-      // FrontendActionFactory from a given FrontendAction type, we call
-      // newFrontendActionFactory<SyntaxOnlyAction>().
-      return Tool.run(new TagsClassActionFactory(tags_db));
+    std::string command(argv[1]);
+
+    // Options are parsed before the database is opened, since --output
+    // names it.  Commands have their options after their name, apart from
+    // indexing, which has no command name.  The argument of a query is
+    // its first positional argument, so one that starts with '-' has to
+    // follow "--".
+    std::vector<char *> args(argv, argv + argc);
+    if (command == "decl" || command == "refs" || command == "members" ||
+        command == "at" || command == "complete" || command == "export" ||
+        command == "serve" || command == "update" || command == "merge" ||
+        command == "watch")
+      args.erase(args.begin() + 1);
+    cl::ParseCommandLineOptions(args.size(), &args[0]);
+
+    bool batch = Batch && (command == "decl" || command == "refs");
+    if (Batch && ! batch)
+      llvm::report_fatal_error("--batch is only for 'decl' and 'refs'");
+
+    SqliteTagsDatabase tags_db(OutputPath);
+
+    if (batch) {
+      // clang-tags decl|refs --batch [--format tsv|json] < NAMES
+      if (BatchFormat != "tsv" && BatchFormat != "json")
+        llvm::report_fatal_error("--format must be 'tsv' or 'json'");
+      std::ios_base::sync_with_stdio(false);
+      tags_db.warm_up();
+      answer_batch(tags_db, command, BatchFormat == "json", std::cin,
+                   stdout);
+    }
+    else if (command == "decl" || command == "refs" ||
+             command == "members" || command == "at") {
+      // clang-tags decl|refs|members|at [--output PATH] ARGUMENT
+      if (BuildPath.empty())
+        llvm::report_fatal_error(
+          "Usage: clang-tags " + command + " [options]" +
+          (command == "at" ? " FILE:LINE:COL" :
+           command == "members" ? " SCOPE" : " NAME"));
+      answer_query(tags_db, command, BuildPath, std::cout);
+    }
+    else if (command == "complete") {
+      // clang-tags complete [--output PATH] PREFIX [COUNT]
+      if (BuildPath.empty())
+        llvm::report_fatal_error(
+          "Usage: clang-tags complete [options] PREFIX [COUNT]");
+      std::string argument(BuildPath);
+      if (! SourcePaths.empty())
+        argument += " " + SourcePaths[0];
+      answer_query(tags_db, command, argument, std::cout);
+    }
+    else if (command == "serve") {
+      // clang-tags serve [--socket PATH] [--index PATH]: answer queries
+      // until interrupted, from CLTAGS or from an exported index.
+      if (! IndexPath.empty()) {
+        MappedTagsDatabase mapped_db(IndexPath);
+        TagsQueryServer Server(mapped_db, SocketPath);
+        return Server.run();
+      }
+      tags_db.warm_up();
+      TagsQueryServer Server(tags_db, SocketPath);
+      return Server.run();
+    }
+    else if (command == "export") {
+      // clang-tags export [--output PATH] INDEX: write a read-only index of
+      // CLTAGS, or of PATH, for serve --index.
+      if (BuildPath.empty())
+        llvm::report_fatal_error("Usage: clang-tags export [options] INDEX");
+      tags_db.export_index(BuildPath);
+    }
+    else if (command == "update") {
+      // clang-tags update <build-path> [options]: re-index only what has
+      // changed since the last run, and unless --fast or --macros-only
+      // what an earlier run of either left at a lesser tier.
+      tags_db.set_batch_limits(BatchRows, BatchBytes);
+
+      IndexedFileSet Unchanged;
+      std::vector<std::string> Sources(
+        tags_db.prepare_update(Unchanged, selected_tier() == TierFull));
+      if (Sources.empty())
+        return 0;
+      llvm::OwningPtr<CompilationDatabase> Compilations(load_compilations());
+      return index_sources(tags_db, *Compilations, Sources, &Unchanged,
+                           true);
+    }
+    else if (command == "watch") {
+      // clang-tags watch <build-path> [options]: keep CLTAGS up to date
+      // as the files indexed in it change, until interrupted.
+      if (BuildPath.empty())
+        llvm::report_fatal_error("Usage: clang-tags watch <build-path>");
+      return watch_sources(tags_db);
+    }
+    else if (command == "merge") {
+      // clang-tags merge [--output PATH] SHARD...: add the databases that
+      // runs with --shard wrote to CLTAGS, or to PATH.
+      std::vector<std::string> Shards;
+      if (! BuildPath.empty())
+        Shards.push_back(BuildPath);
+      Shards.insert(Shards.end(), SourcePaths.begin(), SourcePaths.end());
+      if (Shards.empty())
+        llvm::report_fatal_error("Usage: clang-tags merge SHARD...");
+      tags_db.set_batch_limits(BatchRows, BatchBytes);
+      tags_db.merge_shards(Shards);
+    }
+    else {
+      if (SourcePaths.empty())
+        llvm::report_fatal_error("No source files given to index");
+      tags_db.set_batch_limits(BatchRows, BatchBytes);
+
+      std::vector<std::string> Sources(SourcePaths.begin(),
+                                       SourcePaths.end());
+      if (! Shard.empty())
+        Sources = shard_sources(Sources);
+
+      IndexedFileSet IndexedFiles;
+      if (DedupHeaders)
+        tags_db.load_source_files(IndexedFiles, selected_tier());
+
+      llvm::OwningPtr<CompilationDatabase> Compilations(load_compilations());
+      return index_sources(tags_db, *Compilations, Sources,
+                           DedupHeaders ? &IndexedFiles : NULL, false);
     }
   }
 }